@@ -20,8 +20,15 @@
 #include <vector>
 #include <string>
 #include <stack>
+#include <list>
+#include <set>
+#include <algorithm>
+#include <cstdlib>
+#include <climits>
 
 #include <sys/stat.h>
+#include <unistd.h>
+#include <signal.h>
 #include <jvmti.h>
 
 #include <boost/tokenizer.hpp>
@@ -29,11 +36,140 @@
 
 #include "config.h"
 #include "store.h"
+#include "journal.h"
+#include "symbolizer.h"
+#include "hierarchy.h"
+#include "flight.h"
 using namespace std;
 
 
-typedef std::stack<jmethodID> MethodStack;
-typedef std::map<jthread, MethodStack* > StackThreadMethod;
+// Frame of the per-thread call stack. `trace_id` is the row recorded for the
+// call (0 when it was filtered out or not recording), `context_id` the row of
+// the closest recorded frame, `stack_id` its interned call path, and `depth`
+// the number of recorded frames up to this one. `trigger` is set on the frame
+// that opened the transaction of the thread, and `start` is the entry time of
+// a recorded call.
+struct MethodFrame {
+    jmethodID method_id;
+    unsigned long long trace_id;
+    unsigned long long context_id;
+    unsigned long long stack_id;
+    unsigned int depth;
+    bool trigger;
+    unsigned long long start;
+};
+
+// (caller stack id, method) -> stack id. Bounded: a path evicted from the
+// table gets a new id (and a new `stacks` row) the next time it is seen
+typedef ClockCache<std::pair<unsigned long long, jmethodID>, unsigned long long> StackInterning;
+
+typedef std::stack<MethodFrame> MethodStack;
+
+// Is the method filtered out? Is it a trigger? Decided at its first call,
+// from the tag of its class, and forgotten when the class is unloaded.
+// `named` is set once the symbolizer was asked for its names.
+struct MethodVerdict {
+    unsigned int class_index;
+    bool filtered;
+    bool trigger;
+    bool named;
+};
+
+typedef ClockCache<jmethodID, MethodVerdict> MethodVerdicts;
+
+// Verdicts of the methods of a set of classes
+struct ClassVerdicts {
+    const std::set<unsigned int>& classes;
+
+    ClassVerdicts(const std::set<unsigned int>& _classes)
+     : classes(_classes) {
+    }
+
+    bool operator()(const jmethodID&, const MethodVerdict& verdict) const {
+        return classes.count(verdict.class_index) > 0;
+    }
+};
+
+// Per-thread state of the agent. The thread name is resolved once, when the
+// thread is first seen, and `thread_no` identifies the thread in the journal.
+// With triggers, the thread only records while `transaction_id` is set. In
+// flight recorder mode, its events go to `flight` instead of the worker. With
+// tail sampling, the events of the open transaction wait in
+// `transaction_events` until its latency is known (`transaction_spilled` when
+// there were too many of them, and they are sent as they come). The last
+// exception thrown by the thread waits in `exception` until it is caught, and
+// the monitor it blocks on in `monitor` until it gets it. `allocated_bytes`
+// counts the allocations not sampled yet (VMObjectAlloc only).
+struct ThreadContext {
+    MethodStack stack;
+    std::string thread_name;
+    unsigned int thread_no;
+    unsigned long long transaction_id;
+    FlightRing* flight;
+
+    std::vector<JournalRecord> transaction_events;
+    unsigned long long transaction_start;
+    bool transaction_spilled;
+
+    TraceEvent exception;
+    bool exception_pending;
+
+    TraceEvent monitor;
+    bool monitor_pending;
+
+    unsigned long long allocated_bytes;
+
+    ThreadContext()
+     : thread_no(0), transaction_id(0), flight(0), transaction_start(0), transaction_spilled(false), exception_pending(false),
+       monitor_pending(false), allocated_bytes(0) {
+    }
+
+    ~ThreadContext() {
+        delete flight;
+    }
+
+  private:
+    ThreadContext(const ThreadContext&) {}
+    ThreadContext& operator=(const ThreadContext&) {
+        return *this;
+    }
+};
+
+typedef std::list<ThreadContext*> ThreadContexts;
+
+// Ring of an ended thread, waiting for the next flight dump
+struct EndedFlight {
+    std::string thread_name;
+    unsigned int thread_no;
+    FlightRing* flight;
+};
+
+// Instances and shallow size per class index (0: the untagged classes)
+typedef std::vector<std::pair<unsigned long long, unsigned long long> > HeapCensus;
+
+// Object reached by a retention walk: the node of the object which reached it
+// first, or, when `root` is set (a jvmtiHeapReferenceKind), the class whose
+// reference reached it (`parent`, 0 for a GC root or a class loader)
+struct RetentionNode {
+    unsigned int parent;
+    unsigned int class_index;
+    int root;
+};
+
+struct RetentionWalk {
+    std::vector<RetentionNode> nodes;       // the object tags are the nodes + 1
+    std::vector<unsigned int> wanted;       // samples still to take, per class index
+    std::vector<unsigned int> samples;      // nodes of the sampled instances
+    unsigned int missing;
+};
+
+// (sampled class, root, links from the root: (depth, class))
+typedef boost::tuple<unsigned int, int, std::vector<std::pair<unsigned int, unsigned int> > > TupleRetentionPath;
+
+struct RetentionPath {
+    unsigned long long samples;
+    std::vector<unsigned long long> repeats;    // longest run of each link
+};
 typedef boost::tokenizer<boost::char_separator<char> > Tokenizer;
 
 
@@ -44,95 +180,294 @@ static jrawMonitorID monitor_lock;
 
 static map<string, string> conf;
 static TraceStore store;
-static vector<string> loadedClasses;
-static StackThreadMethod thread_methodid_stack;
+static ThreadContexts thread_contexts;
+static StackInterning stack_interning;
+static MethodVerdicts method_verdicts;
+static unsigned int thread_counter = 0;
+static unsigned int selected_threads = 0;
+static unsigned int excluded_threads = 0;
+
+static EventJournal journal;
+static Symbolizer symbolizer;
+static ClassHierarchy hierarchy;
+static unsigned int serializable_bit = 0;
+
+// Classes whose tag was freed (unloaded), for the inventory thread. Guarded by
+// its own monitor: ObjectFree must not wait on `monitor_lock`
+static jrawMonitorID unload_lock;
+static vector<unsigned int> unloaded_classes;
+static bool inventory_running = false;
+
+static struct sigaction previous_abort_action;
+
+// Set by VMDeath: the queue is drained and the DB saved from there
+static bool vm_dead = false;
+
+// Flight recorder (`flight` option, events kept per thread; 0 when off) and
+// its triggers. The signal and the control file are polled by the flight
+// thread, the other triggers dump from the callbacks.
+static size_t flight_events = 0;
+static unsigned long long flight_latency = 0;
+static vector<string> flight_exceptions;
+static string flight_control;
+static volatile sig_atomic_t flight_requested = 0;
+static jrawMonitorID flight_lock;
+static bool flight_running = false;
+static unsigned long long flight_dumps = 0;
+static unsigned long long last_flight_dump = 0;
+
+// Rings of the ended threads until the next dump (at most
+// FLIGHT_ENDED_THREADS)
+static list<EndedFlight> ended_flights;
+
+// Tail sampling (`tail_latency` in ms, `tail_percentile`): a transaction is
+// only kept when it is slow, compared to the other activations of its trigger
+static unsigned long long tail_latency = 0;
+static double tail_percentile = 0;
+static map<jmethodID, LatencyHistogram> transaction_latencies;
+static unsigned long long tail_kept = 0;
+static unsigned long long tail_discarded = 0;
+
+static bool tail_sampling() {
+    return tail_latency || tail_percentile > 0;
+}
 
+// Record the thrown exceptions (`exceptions` option)
+static bool record_exceptions = false;
+static unsigned long long exceptions_recorded = 0;
 
+// Record the time blocked on monitors (`monitors` option)
+static bool record_monitors = false;
+static unsigned long long monitor_events = 0;
 
-static jvmtiIterationControl JNICALL heapObject(jlong class_tag, jlong size, jlong* tag_ptr, void* user_data) {
-    return JVMTI_ITERATION_CONTINUE;
-}
+// Allocation sampling (`allocations` option, one sample every
+// `allocation_interval` bytes; 0 when off). The JVM samples them when it can
+// (`sampled_allocations`), otherwise the agent samples what VMObjectAlloc sees
+static unsigned long long allocation_interval = 0;
+static bool sampled_allocations = false;
+static unsigned long long allocation_samples = 0;
 
-// Get the list of loaded classes
-// at the init of the VM
-static void JNICALL vm_init(jvmtiEnv *jvmti, JNIEnv *env, jthread thread) {
-    jint returnCode;
-    jint numberOfClasses = 0;
-    jclass *classes = 0;
+// Heap census (`heap_census` option, its period in s, 0 for on demand only).
+// Taken by the census thread, on its period or on DataDumpRequest (SIGQUIT)
+static bool heap_census_enabled = false;
+static unsigned long long heap_census_period = 0;
+static jrawMonitorID census_lock;
+static bool census_running = false;
+static bool census_requested = false;
+static unsigned long long heap_censuses = 0;
+static unsigned long long heap_census_time = 0;
+static unsigned long long last_heap_census = 0;
+static HeapCensus previous_census;
 
-    returnCode =  globalJVMTIInterface->GetLoadedClasses(&numberOfClasses, &classes);
-    if (returnCode != JVMTI_ERROR_NONE) {
-        cout << "Cannot get the list of classes..." << endl;
-        exit(-1);
-    }
+// Set while a census (and its retention walk) holds class indexes and
+// `previous_census` without `monitor_lock`
+static bool census_active = false;
 
-    for (unsigned i=0; i<numberOfClasses; i++) {
-        char* signature = 0;
-        char* generic = 0;
+// Retention paths of the leak suspects of each census (`retention_paths`
+// option, samples per suspect; 0 when off)
+static unsigned int retention_samples = 0;
+static unsigned long long retention_walks = 0;
+static unsigned long long retention_time = 0;
 
-        // jvmti->IterateOverHeap(JVMTI_HEAP_OBJECT_EITHER, &heapObject, 0);
 
-        globalJVMTIInterface->GetClassSignature(classes[i], &signature, &generic);
 
-        if(signature) {
-            returnCode = globalJVMTIInterface->Deallocate((unsigned char*) signature);
-        }
-        loadedClasses.push_back(string(signature));
-    }
-    cout << "Agent::vm_init- Loaded classes: " << loadedClasses.size() << endl;
-}
+// Compute the verdicts of a class and keep them in its tag, along with its
+// index in the hierarchy
+static jlong tag_class(jvmtiEnv *jvmti, JNIEnv* jni_env, jclass klass) {
+    unsigned int class_index = hierarchy.add(jvmti, jni_env, klass);
 
+    jlong flags = CLASS_TAGGED;
 
-static void JNICALL vm_death(jvmtiEnv *jvmti, JNIEnv *env) {
-    // Need a failsafe here?
-    cout << "Agent::vm_death- Does this happen?" << endl;
+    // Should we filter out the class?
+    if (store.filter(hierarchy.signature(class_index)))
+        flags |= CLASS_FILTERED;
+
+    // Capture if the object is serializable
+    if (hierarchy.implements(class_index, serializable_bit))
+        flags |= CLASS_SERIALIZABLE;
+
+    if (store.trigger_class(hierarchy.signature(class_index)))
+        flags |= CLASS_TRIGGER;
+
+    jlong tag = ClassHierarchy::make_tag(class_index, flags);
+    jvmti->SetTag(klass, tag);
+    return tag;
 }
 
 
-static void JNICALL vm_exception(jvmtiEnv *jvmti_env, JNIEnv* env, jthread thr, jmethodID method, jlocation location, jobject exception, jmethodID catch_method, jlocation catch_location) {
-    cout << "Agent::vm_exception- Does this happen?" << endl;
+// Verdicts of a class; the classes prepared before the ClassPrepare events
+// were enabled get tagged on first use
+static jlong class_tag(jvmtiEnv *jvmti, JNIEnv* jni_env, jclass klass) {
+    jlong tag = 0;
+    jvmti->GetTag(klass, &tag);
+    if (!(tag & CLASS_TAGGED))
+        tag = tag_class(jvmti, jni_env, klass);
+    return tag;
 }
 
 
+static void JNICALL class_prepare(jvmtiEnv *jvmti, JNIEnv* jni_env, jthread thread, jclass klass) {
+    globalJVMTIInterface->RawMonitorEnter(monitor_lock);
+    tag_class(jvmti, jni_env, klass);
+    globalJVMTIInterface->RawMonitorExit(monitor_lock);
+}
 
-static void get_classname(jvmtiEnv *jvmti, jmethodID methodId, string& clazz, string& generic) {
-    jclass declaring_class;
-    char *class_signature, *class_generic;
 
-    // Get the Class information
-    jvmti->GetMethodDeclaringClass(methodId, &declaring_class);
-    jvmti->GetClassSignature(declaring_class, &class_signature, &class_generic);
-    
-    if (class_signature) {
-        clazz.assign(class_signature);
-        jvmti->Deallocate(reinterpret_cast<unsigned char*>(class_signature));
+// Hand the names resolved by the symbolizer over to the worker (and the
+// journal), in order with the events
+static void publish_symbols(const vector<MethodSymbol>& symbols) {
+    globalJVMTIInterface->RawMonitorEnter(monitor_lock);
+    for (vector<MethodSymbol>::const_iterator iter=symbols.begin(); iter!=symbols.end(); ++iter) {
+        journal.method(iter->method_id, iter->class_name, iter->method_name, iter->signature_name);
+
+        TraceEvent e;
+        e.kind = TRACE_SYMBOL;
+        e.method_id = iter->method_id;
+        e.class_name = iter->class_name;
+        e.method_name = iter->method_name;
+        e.signature_name = iter->signature_name;
+        store.push(e);
     }
-    if (class_generic) {
-        generic.assign(class_generic);
-        jvmti->Deallocate(reinterpret_cast<unsigned char*>(class_generic));
+    globalJVMTIInterface->RawMonitorExit(monitor_lock);
+}
+
+
+// Memory of the caches of the callbacks, for the `agent_metrics` table; the
+// worker adds its own when it writes them (caller holds `monitor_lock`)
+static void publish_metrics() {
+    AgentMetrics metrics;
+    method_verdicts.report("agent.verdicts", metrics);
+    stack_interning.report("agent.stacks", metrics);
+    store.filter_cache.report("agent.filters", metrics);
+    metrics["agent.threads"] = thread_contexts.size();
+    metrics["agent.threads.selected"] = selected_threads;
+    metrics["agent.threads.excluded"] = excluded_threads;
+    metrics["agent.flight.dumps"] = flight_dumps;
+    metrics["agent.tail.sampled"] = tail_sampling() ? 1 : 0;
+    metrics["agent.tail.kept"] = tail_kept;
+    metrics["agent.tail.discarded"] = tail_discarded;
+    metrics["agent.exceptions"] = exceptions_recorded;
+    metrics["agent.monitor_events"] = monitor_events;
+    metrics["agent.allocations.samples"] = allocation_samples;
+    metrics["agent.allocations.interval"] = allocation_interval;
+    metrics["agent.heap.censuses"] = heap_censuses;
+    metrics["agent.heap.census_time"] = heap_census_time;
+    metrics["agent.heap.retention_walks"] = retention_walks;
+    metrics["agent.heap.retention_time"] = retention_time;
+    metrics["agent.classes"] = hierarchy.loaded();
+    metrics["agent.classes.slots"] = hierarchy.size();
+    metrics["agent.classes.bytes"] = hierarchy.memory();
+
+    for (AgentMetrics::const_iterator iter=metrics.begin(); iter!=metrics.end(); ++iter) {
+        TraceEvent e;
+        e.kind = TRACE_METRIC;
+        e.class_name = iter->first;
+        e.sequence = iter->second;
+        store.push(e);
     }
 }
 
-static void get_metod(jvmtiEnv *jvmti, jmethodID methodId, string& method, string& sig) {
-    char *method_name, *method_signature, *method_generic;
 
-    // Get the method
-    jvmti->GetMethodName(methodId, &method_name, &method_signature, &method_generic);
+// Split the memory budget between the caches of the callbacks and the store
+static void set_cache_budget(const size_t bytes) {
+    method_verdicts.set_budget(bytes / 20 * 3);
+    stack_interning.set_budget(bytes / 20 * 7);
+    store.set_cache_budget(bytes);
+}
 
-    if (method_name) {
-        method.assign(method_name);
-        jvmti->Deallocate(reinterpret_cast<unsigned char*>(method_name));
+
+// Let the next classes take the slots of the unloaded ones, unless a census
+// runs; the next census does not compare them with their previous class
+// (caller holds `monitor_lock`)
+static void recycle_classes() {
+    if (census_active)
+        return;
+
+    vector<unsigned int> recycled;
+    hierarchy.recycle(recycled);
+    for (vector<unsigned int>::const_iterator iter=recycled.begin(); iter!=recycled.end(); ++iter) {
+        if (*iter < previous_census.size())
+            previous_census[*iter] = make_pair(0ULL, 0ULL);
     }
-    if (method_signature) {
-        sig.assign(method_signature);
-        jvmti->Deallocate(reinterpret_cast<unsigned char*>(method_signature));
+}
+
+
+// Tag the loaded classes not tagged yet, and the array classes if asked (they
+// are never prepared). Only holds `monitor_lock` one class at a time.
+static void tag_loaded_classes(jvmtiEnv *jvmti, JNIEnv *env, bool arrays) {
+    jint numberOfClasses = 0;
+    jclass *classes = 0;
+
+    if (JVMTI_ERROR_NONE == jvmti->GetLoadedClasses(&numberOfClasses, &classes)) {
+        for (jint i=0; i<numberOfClasses; i++) {
+            jint status = 0;
+            jvmti->GetClassStatus(classes[i], &status);
+
+            bool array = (status & JVMTI_CLASS_STATUS_ARRAY) != 0;
+            if (!(status & JVMTI_CLASS_STATUS_PRIMITIVE) && (array ? arrays : (status & JVMTI_CLASS_STATUS_PREPARED) != 0)) {
+                jvmti->RawMonitorEnter(monitor_lock);
+                class_tag(jvmti, env, classes[i]);
+                jvmti->RawMonitorExit(monitor_lock);
+            }
+            env->DeleteLocalRef(classes[i]);
+        }
+        jvmti->Deallocate(reinterpret_cast<unsigned char*>(classes));
     }
-    if (method_generic) {
-        jvmti->Deallocate(reinterpret_cast<unsigned char*>(method_generic));
+}
+
+
+// Tag the classes loaded before the agent saw them, then keep the hierarchy
+// current with the unloaded classes. Runs on its own agent thread so that the
+// VM startup does not wait for it.
+static void JNICALL class_inventory(jvmtiEnv *jvmti, JNIEnv *env, void *arg) {
+    tag_loaded_classes(jvmti, env, false);
+
+    jvmti->RawMonitorEnter(monitor_lock);
+    cout << "Agent::class_inventory- Classes: " << hierarchy.size() << endl;
+    publish_metrics();
+    jvmti->RawMonitorExit(monitor_lock);
+
+    vector<unsigned int> unloaded;
+    jvmti->RawMonitorEnter(unload_lock);
+    while (inventory_running) {
+        if (unloaded_classes.empty()) {
+            jvmti->RawMonitorWait(unload_lock, 0);
+            continue;
+        }
+        unloaded.swap(unloaded_classes);
+        jvmti->RawMonitorExit(unload_lock);
+
+        // Forget the verdicts of the unloaded classes (their jmethodIDs are dead)
+        set<unsigned int> classes(unloaded.begin(), unloaded.end());
+        jvmti->RawMonitorEnter(monitor_lock);
+        for (set<unsigned int>::const_iterator iter=classes.begin(); iter!=classes.end(); ++iter) {
+            store.forget_class(hierarchy.signature(*iter));
+            hierarchy.unload(*iter);
+        }
+        method_verdicts.erase_if(ClassVerdicts(classes));
+        recycle_classes();
+        jvmti->RawMonitorExit(monitor_lock);
+        unloaded.clear();
+
+        jvmti->RawMonitorEnter(unload_lock);
     }
+    jvmti->RawMonitorExit(unload_lock);
+}
 
+
+// A tagged object was collected: for a class, it was unloaded
+static void JNICALL object_free(jvmtiEnv *jvmti, jlong tag) {
+    unsigned int class_index = ClassHierarchy::tag_index(tag);
+    if (!class_index || (tag & (CLASS_LOADER | OBJECT_RETAINED)))
+        return;
+
+    jvmti->RawMonitorEnter(unload_lock);
+    unloaded_classes.push_back(class_index);
+    jvmti->RawMonitorNotify(unload_lock);
+    jvmti->RawMonitorExit(unload_lock);
 }
 
+
 static void get_thread(jvmtiEnv *jvmti, jthread thread, string& thread_name) {
     // Extract thread-info (its name)
     jvmtiThreadInfo thread_info;
@@ -143,82 +478,890 @@ static void get_thread(jvmtiEnv *jvmti, jthread thread, string& thread_name) {
 }
 
 
-static void JNICALL method_exit(jvmtiEnv *jvmti, JNIEnv* jni_env, jthread thread, jmethodID methodId, jboolean exception_raised, jvalue return_value) {
-    globalJVMTIInterface->RawMonitorEnter(monitor_lock);
+static jvmtiEvent allocation_event() {
+#ifdef USE_SAMPLED_ALLOCATION
+    if (sampled_allocations)
+        return JVMTI_EVENT_SAMPLED_OBJECT_ALLOC;
+#endif
+    return JVMTI_EVENT_VM_OBJECT_ALLOC;
+}
+
 
-    MethodStack *current_stack = 0;
-    StackThreadMethod::const_iterator iter = thread_methodid_stack.find(thread);
+// The jthread given to the callbacks is a local reference, it cannot be used
+// as a key: the context of each thread is kept in the JVMTI thread-local storage
+static ThreadContext* get_context(jvmtiEnv *jvmti, jthread thread) {
+    ThreadContext *context = 0;
+    jvmti->GetThreadLocalStorage(thread, reinterpret_cast<void**>(&context));
 
-    if (iter == thread_methodid_stack.end()) {
-        thread_methodid_stack[thread] = new MethodStack();
-        current_stack = thread_methodid_stack.at(thread);
+    if (!context) {
+        context = new ThreadContext();
+        get_thread(jvmti, thread, context->thread_name);
+        context->thread_no = ++thread_counter;
+        journal.thread(context->thread_no, context->thread_name);
+        jvmti->SetThreadLocalStorage(thread, context);
+        thread_contexts.push_back(context);
     }
-    else
-        current_stack = iter->second;
+    return context;
+}
+
 
-    current_stack->pop();
+// With a thread filter, the method (and exception) events are only enabled
+// for the selected threads: the others never enter the callbacks. The name is
+// the one the thread has when it starts. The context of the thread is made
+// then, so that the threads seen at ThreadStart are skipped by VMInit.
+static void select_thread(jvmtiEnv *jvmti, jthread thread) {
+    globalJVMTIInterface->RawMonitorEnter(monitor_lock);
+    ThreadContext *context = 0;
+    jvmti->GetThreadLocalStorage(thread, reinterpret_cast<void**>(&context));
+    if (context) {
+        globalJVMTIInterface->RawMonitorExit(monitor_lock);
+        return;
+    }
 
+    context = get_context(jvmti, thread);
+    bool selected = store.thread_selected(context->thread_name);
+    if (selected)
+        selected_threads++;
+    else
+        excluded_threads++;
     globalJVMTIInterface->RawMonitorExit(monitor_lock);
+
+    if (selected) {
+        jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_METHOD_ENTRY, thread);
+        jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_METHOD_EXIT, thread);
+        if (record_exceptions || !flight_exceptions.empty())
+            jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_EXCEPTION, thread);
+        if (record_exceptions)
+            jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_EXCEPTION_CATCH, thread);
+        if (record_monitors) {
+            jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_MONITOR_CONTENDED_ENTER, thread);
+            jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_MONITOR_CONTENDED_ENTERED, thread);
+            jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_MONITOR_WAIT, thread);
+            jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_MONITOR_WAITED, thread);
+        }
+        if (allocation_interval)
+            jvmti->SetEventNotificationMode(JVMTI_ENABLE, allocation_event(), thread);
+    }
 }
 
-// Dump information for each entry of method (at each call)
-// TODO: cache the methodId -> tuple(class, method, signature)
-static void JNICALL method_entry(jvmtiEnv *jvmti, JNIEnv* jni_env, jthread thread, jmethodID methodId) {
-    globalJVMTIInterface->RawMonitorEnter(monitor_lock);
-    MethodStack *current_stack = 0;
-    StackThreadMethod::const_iterator iter = thread_methodid_stack.find(thread);
 
-    if (iter == thread_methodid_stack.end()) {
-        thread_methodid_stack[thread] = new MethodStack();
-        current_stack = thread_methodid_stack.at(thread);
+static void JNICALL thread_start(jvmtiEnv *jvmti, JNIEnv* jni_env, jthread thread) {
+    if (store.has_thread_filter())
+        select_thread(jvmti, thread);
+}
+
+
+// The fate of the last exception of the thread is known: send it to the
+// worker. It skips the flight ring and the transaction buffer, which only
+// hold calls, so the rows it links to may never be written.
+static void send_exception(ThreadContext* context) {
+    context->exception_pending = false;
+    context->exception.thread_name = context->thread_name;
+    context->exception.thread_no = context->thread_no;
+    store.push(context->exception);
+    exceptions_recorded++;
+}
+
+
+// The worker drops its state of the thread: nothing of the thread is pushed
+// after this event
+static void send_thread_end(const string& thread_name, const unsigned int thread_no) {
+    TraceEvent e;
+    e.kind = TRACE_THREAD_END;
+    e.thread_name = thread_name;
+    e.thread_no = thread_no;
+    store.push(e);
+}
+
+
+// Drain the rings of every thread to the store and save the DB; the triggers
+// firing within FLIGHT_MIN_INTERVAL_MS of a dump are ignored (the events stay
+// in the rings). Caller holds `monitor_lock`.
+static void flight_dump(const string& reason) {
+    jlong now = 0;
+    globalJVMTIInterface->GetTime(&now);
+    if (flight_dumps && static_cast<unsigned long long>(now) - last_flight_dump < FLIGHT_MIN_INTERVAL_MS * 1000000ULL)
+        return;
+    last_flight_dump = now;
+    flight_dumps++;
+
+    size_t events = 0;
+    for (ThreadContexts::const_iterator iter=thread_contexts.begin(); iter!=thread_contexts.end(); ++iter) {
+        if ((*iter)->flight)
+            events += (*iter)->flight->drain(store, (*iter)->thread_name);
     }
-    else
-        current_stack = iter->second;
+    for (list<EndedFlight>::iterator iter=ended_flights.begin(); iter!=ended_flights.end(); ++iter) {
+        events += iter->flight->drain(store, iter->thread_name);
+        send_thread_end(iter->thread_name, iter->thread_no);
+        delete iter->flight;
+    }
+    ended_flights.clear();
+    cout << "Agent::flight_dump- " << reason << ": " << events << " events" << endl;
+    store.dump();
+}
 
-    current_stack->push(methodId);
+
+static void flight_signal(int signal_number) {
+    flight_requested = 1;
+}
 
 
-    if (!store.start_recording) {
+// Poll the triggers that cannot dump by themselves: the signal (its handler
+// cannot take the monitor) and the control file, removed once seen
+static void JNICALL flight_recorder(jvmtiEnv *jvmti, JNIEnv *env, void *arg) {
+    jvmti->RawMonitorEnter(flight_lock);
+    while (flight_running) {
+        jvmti->RawMonitorWait(flight_lock, FLIGHT_POLL_MS);
+
         struct stat fileInfo;
-        bool file_exists = stat("/Users/rgaucher/Downloads/Threadfix/start-recording", &fileInfo) == 0;
+        bool control = !flight_control.empty() && stat(flight_control.c_str(), &fileInfo) == 0;
+        if (control)
+            unlink(flight_control.c_str());
+
+        if (flight_requested || control) {
+            jvmti->RawMonitorEnter(monitor_lock);
+            if (!vm_dead)
+                flight_dump(flight_requested ? "signal" : "control file");
+            jvmti->RawMonitorExit(monitor_lock);
+            flight_requested = 0;
+        }
+    }
+    jvmti->RawMonitorExit(flight_lock);
+}
+
 
-        if (file_exists)
-            store.start_recording = true;
+// Count an object in the census. Runs with the VM stopped: no JNI, no JVMTI
+static jint JNICALL census_object(jlong class_tag, jlong size, jlong* tag_ptr, jint length, void* user_data) {
+    HeapCensus& census = *static_cast<HeapCensus*>(user_data);
+    unsigned int class_index = ClassHierarchy::tag_index(class_tag);
+    if (class_index >= census.size())
+        class_index = 0;
+
+    census[class_index].first++;
+    census[class_index].second += size;
+    return 0;
+}
+
+
+// Follow a reference from the GC roots: the first one to reach an object gives
+// its node, tagged on the object. The classes and the class loaders keep
+// their tag, they root what they refer to. Stops the walk once every sample
+// is taken or RETENTION_MAX_OBJECTS are reached. No JNI, no JVMTI.
+static jint JNICALL retention_reference(jvmtiHeapReferenceKind reference_kind, const jvmtiHeapReferenceInfo* reference_info,
+                                        jlong class_tag, jlong referrer_class_tag, jlong size, jlong* tag_ptr,
+                                        jlong* referrer_tag_ptr, jint length, void* user_data) {
+    RetentionWalk& walk = *static_cast<RetentionWalk*>(user_data);
+    if (*tag_ptr)
+        return (*tag_ptr & OBJECT_RETAINED) ? 0 : JVMTI_VISIT_OBJECTS;
+
+    if (walk.nodes.size() >= RETENTION_MAX_OBJECTS)
+        return JVMTI_VISIT_ABORT;
+
+    RetentionNode node = {0, ClassHierarchy::tag_index(class_tag), 0};
+    if (node.class_index >= walk.wanted.size())
+        node.class_index = 0;
+
+    jlong referrer = referrer_tag_ptr ? *referrer_tag_ptr : 0;
+    if (referrer & OBJECT_RETAINED)
+        node.parent = ClassHierarchy::tag_index(referrer) - 1;
+    else if (referrer & CLASS_LOADER)
+        node.root = JVMTI_HEAP_REFERENCE_CLASS_LOADER;
+    else {
+        node.root = reference_kind;
+        node.parent = ClassHierarchy::tag_index(referrer);
+    }
+
+    walk.nodes.push_back(node);
+    *tag_ptr = ClassHierarchy::make_tag(walk.nodes.size(), OBJECT_RETAINED);
+
+    if (walk.wanted[node.class_index]) {
+        walk.wanted[node.class_index]--;
+        walk.samples.push_back(walk.nodes.size() - 1);
+        if (!--walk.missing)
+            return JVMTI_VISIT_ABORT;
+    }
+    return JVMTI_VISIT_OBJECTS;
+}
+
+
+// Remove the tags of a retention walk
+static jint JNICALL untag_retained(jlong class_tag, jlong size, jlong* tag_ptr, jint length, void* user_data) {
+    if (*tag_ptr & OBJECT_RETAINED)
+        *tag_ptr = 0;
+    return 0;
+}
+
+
+static const char* retention_root(const int root) {
+    switch (root) {
+    case JVMTI_HEAP_REFERENCE_STATIC_FIELD:
+        return "static field";
+    case JVMTI_HEAP_REFERENCE_CONSTANT_POOL:
+        return "constant pool";
+    case JVMTI_HEAP_REFERENCE_CLASS_LOADER:
+        return "class loader";
+    case JVMTI_HEAP_REFERENCE_JNI_GLOBAL:
+        return "JNI global";
+    case JVMTI_HEAP_REFERENCE_SYSTEM_CLASS:
+        return "system class";
+    case JVMTI_HEAP_REFERENCE_MONITOR:
+        return "monitor";
+    case JVMTI_HEAP_REFERENCE_STACK_LOCAL:
+        return "stack local";
+    case JVMTI_HEAP_REFERENCE_JNI_LOCAL:
+        return "JNI local";
+    case JVMTI_HEAP_REFERENCE_THREAD:
+        return "thread";
+    }
+    return "other";
+}
+
+
+// Paths from the GC roots to samples of the classes which grew the most since
+// the previous census, merged when they go through the same classes. A run of
+// objects of the same class (linked lists, trees) is one link, and only the
+// ends of a path longer than RETENTION_PATH_DEPTH links are kept.
+static void trace_leak_suspects(jvmtiEnv *jvmti, const HeapCensus& census) {
+    std::vector<std::pair<unsigned long long, unsigned int> > growths;
+    for (size_t i=1; i<census.size(); i++) {
+        unsigned long long before = i < previous_census.size() ? previous_census[i].second : 0;
+        if (census[i].second >= before + LEAK_SUSPECT_MIN_GROWTH)
+            growths.push_back(std::make_pair(census[i].second - before, i));
+    }
+    if (growths.empty())
+        return;
+
+    size_t suspects = std::min(growths.size(), static_cast<size_t>(LEAK_SUSPECT_CLASSES));
+    std::partial_sort(growths.begin(), growths.begin() + suspects, growths.end(), std::greater<std::pair<unsigned long long, unsigned int> >());
+
+    RetentionWalk walk;
+    walk.wanted.resize(census.size(), 0);
+    walk.missing = 0;
+    for (size_t i=0; i<suspects; i++) {
+        walk.wanted[growths[i].second] = retention_samples;
+        walk.missing += retention_samples;
+    }
+
+    jvmtiHeapCallbacks callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.heap_reference_callback = &retention_reference;
+
+    jlong start = 0, end = 0;
+    jvmti->GetTime(&start);
+    jvmtiError error = jvmti->FollowReferences(0, 0, 0, &callbacks, &walk);
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.heap_iteration_callback = &untag_retained;
+    jvmti->IterateThroughHeap(JVMTI_HEAP_FILTER_UNTAGGED, 0, &callbacks, 0);
+    jvmti->GetTime(&end);
+
+    if (JVMTI_ERROR_NONE != error) {
+        cout << "Agent::trace_leak_suspects- FollowReferences failed: " << error << endl;
+        return;
+    }
+
+    std::map<TupleRetentionPath, RetentionPath> paths;
+    for (size_t s=0; s<walk.samples.size(); s++) {
+        // Classes from the sample up to its root
+        std::vector<unsigned int> chain;
+        const RetentionNode* node = &walk.nodes[walk.samples[s]];
+        while (!node->root) {
+            node = &walk.nodes[node->parent];
+            chain.push_back(node->class_index);
+        }
+        if (node->parent)
+            chain.push_back(node->parent);
+
+        std::vector<std::pair<unsigned int, unsigned long long> > runs;
+        for (size_t i=chain.size(); i-- > 0;) {
+            if (!runs.empty() && runs.back().first == chain[i])
+                runs.back().second++;
+            else
+                runs.push_back(std::make_pair(chain[i], 1ULL));
+        }
+
+        TupleRetentionPath key(walk.nodes[walk.samples[s]].class_index, node->root, std::vector<std::pair<unsigned int, unsigned int> >());
+        std::vector<unsigned long long> repeats;
+        const size_t half = RETENTION_PATH_DEPTH / 2;
+        for (size_t i=0; i<runs.size(); i++) {
+            unsigned int depth = i;
+            if (runs.size() > RETENTION_PATH_DEPTH) {
+                if (i >= half && i < runs.size() - half)
+                    continue;
+                if (i >= half)
+                    depth = half + 1 + i - (runs.size() - half);
+            }
+            key.get<2>().push_back(std::make_pair(depth, runs[i].first));
+            repeats.push_back(runs[i].second);
+        }
+
+        std::map<TupleRetentionPath, RetentionPath>::iterator iter = paths.find(key);
+        if (iter == paths.end()) {
+            RetentionPath path = {0, repeats};
+            iter = paths.insert(std::make_pair(key, path)).first;
+        }
+        iter->second.samples++;
+        for (size_t i=0; i<repeats.size(); i++)
+            iter->second.repeats[i] = std::max(iter->second.repeats[i], repeats[i]);
+    }
+
+    jvmti->RawMonitorEnter(monitor_lock);
+    if (!vm_dead) {
+        std::map<TupleRetentionPath, RetentionPath>::const_iterator iter;
+        for (iter=paths.begin(); iter!=paths.end(); ++iter) {
+            const std::vector<std::pair<unsigned int, unsigned int> >& links = iter->first.get<2>();
+            for (size_t i=0; i<links.size(); i++) {
+                TraceEvent e;
+                e.kind = TRACE_RETENTION_LINK;
+                e.class_name = links[i].second ? hierarchy.signature(links[i].second) : "?";
+                e.depth = links[i].first;
+                e.sequence = iter->second.repeats[i];
+                store.push(e);
+            }
+
+            TraceEvent e;
+            e.kind = TRACE_RETENTION_PATH;
+            e.class_name = hierarchy.signature(iter->first.get<0>());
+            e.method_name = retention_root(iter->first.get<1>());
+            e.sequence = iter->second.samples;
+            store.push(e);
+        }
+
+        retention_walks++;
+        retention_time += end - start;
+        cout << "Agent::trace_leak_suspects- " << suspects << " suspects, " << walk.samples.size() << " samples, "
+             << paths.size() << " paths over " << walk.nodes.size() << " objects in " << (end - start) / 1000000 << " ms" << endl;
+    }
+    jvmti->RawMonitorExit(monitor_lock);
+}
+
+
+// Instances and shallow size of every class, from the class tags. The pause
+// (IterateThroughHeap stops the VM) is the duration of the snapshot. At most
+// one census every HEAP_CENSUS_MIN_INTERVAL_MS.
+static void take_heap_census(jvmtiEnv *jvmti, JNIEnv *env, const string& reason) {
+    jlong now = 0;
+    jvmti->GetTime(&now);
+    if (heap_censuses && static_cast<unsigned long long>(now) - last_heap_census < HEAP_CENSUS_MIN_INTERVAL_MS * 1000000ULL) {
+        cout << "Agent::take_heap_census- Skipped the " << reason << " census, the last one is too recent" << endl;
+        return;
+    }
+
+    tag_loaded_classes(jvmti, env, true);
+
+    jvmti->RawMonitorEnter(monitor_lock);
+    census_active = true;
+    HeapCensus census(hierarchy.size() + 1);
+    jvmti->RawMonitorExit(monitor_lock);
+
+    jvmtiHeapCallbacks callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.heap_iteration_callback = &census_object;
+
+    jlong start = 0, end = 0;
+    jvmti->GetTime(&start);
+    jvmtiError error = jvmti->IterateThroughHeap(0, 0, &callbacks, &census);
+    jvmti->GetTime(&end);
+    last_heap_census = start;
+
+    if (JVMTI_ERROR_NONE != error) {
+        cout << "Agent::take_heap_census- IterateThroughHeap failed: " << error << endl;
+        jvmti->RawMonitorEnter(monitor_lock);
+        census_active = false;
+        jvmti->RawMonitorExit(monitor_lock);
+        return;
+    }
+
+    jvmti->RawMonitorEnter(monitor_lock);
+    if (!vm_dead) {
+        unsigned long long instances = 0;
+        for (size_t i=0; i<census.size(); i++) {
+            if (!census[i].first)
+                continue;
+
+            TraceEvent e;
+            e.kind = TRACE_HEAP_CLASS;
+            e.class_name = i ? hierarchy.signature(i) : "?";
+            e.sequence = census[i].first;
+            e.size = census[i].second;
+            store.push(e);
+            instances += census[i].first;
+        }
+
+        TraceEvent e;
+        e.kind = TRACE_HEAP_SNAPSHOT;
+        e.class_name = reason;
+        e.timestamp = start;
+        e.sequence = end - start;
+        store.push(e);
+
+        heap_censuses++;
+        heap_census_time += end - start;
+        cout << "Agent::take_heap_census- " << reason << ": " << instances << " objects in " << (end - start) / 1000000 << " ms" << endl;
+    }
+    jvmti->RawMonitorExit(monitor_lock);
+
+    if (retention_samples && !previous_census.empty() && !vm_dead)
+        trace_leak_suspects(jvmti, census);
+    previous_census.swap(census);
+
+    jvmti->RawMonitorEnter(monitor_lock);
+    census_active = false;
+    recycle_classes();
+    jvmti->RawMonitorExit(monitor_lock);
+}
+
+
+// Take the censuses asked for, and the periodic ones
+static void JNICALL heap_census(jvmtiEnv *jvmti, JNIEnv *env, void *arg) {
+    jvmti->RawMonitorEnter(census_lock);
+    while (census_running) {
+        if (!census_requested)
+            jvmti->RawMonitorWait(census_lock, heap_census_period);
+
+        // Without a period, only the requests wake the thread up
+        if (!census_running || (!census_requested && !heap_census_period))
+            continue;
+
+        string reason = census_requested ? "request" : "periodic";
+        census_requested = false;
+        jvmti->RawMonitorExit(census_lock);
+
+        take_heap_census(jvmti, env, reason);
+        jvmti->RawMonitorEnter(census_lock);
+    }
+    jvmti->RawMonitorExit(census_lock);
+}
+
+
+// Ctrl-Break or SIGQUIT (kill -3): ask for a heap census
+static void JNICALL data_dump_request(jvmtiEnv *jvmti) {
+    jvmti->RawMonitorEnter(census_lock);
+    census_requested = true;
+    jvmti->RawMonitorNotify(census_lock);
+    jvmti->RawMonitorExit(census_lock);
+}
+
+
+static void JNICALL vm_init(jvmtiEnv *jvmti, JNIEnv *env, jthread thread) {
+    // The threads started before the ThreadStart events
+    if (store.has_thread_filter()) {
+        jint threads_count = 0;
+        jthread* threads = 0;
+        if (JVMTI_ERROR_NONE == jvmti->GetAllThreads(&threads_count, &threads)) {
+            for (jint i=0; i<threads_count; i++) {
+                select_thread(jvmti, threads[i]);
+                env->DeleteLocalRef(threads[i]);
+            }
+            jvmti->Deallocate(reinterpret_cast<unsigned char*>(threads));
+        }
+    }
+
+    symbolizer.start(jvmti, env, &publish_symbols);
+
+    if (flight_events) {
+        flight_running = true;
+        if (!run_agent_thread(jvmti, env, "Trace Flight Recorder", &flight_recorder, 0)) {
+            cout << "Agent::vm_init- Cannot start the flight recorder thread, no dump on signal or control file" << endl;
+            flight_running = false;
+        }
+    }
+
+    if (heap_census_enabled) {
+        census_running = true;
+        if (!run_agent_thread(jvmti, env, "Trace Heap Census", &heap_census, 0)) {
+            cout << "Agent::vm_init- Cannot start the heap census thread, no census" << endl;
+            census_running = false;
+        }
+    }
+
+    inventory_running = true;
+    if (!run_agent_thread(jvmti, env, "Trace Class Inventory", &class_inventory, 0)) {
+        cout << "Agent::vm_init- Cannot start the class inventory, the classes are tagged on first use" << endl;
+        inventory_running = false;
+    }
+}
+
+
+// Last event sent by the VM: drain the queue and save the DB while the VM
+// still waits for us, Agent_OnUnload is not called on every exit path
+static void JNICALL vm_death(jvmtiEnv *jvmti, JNIEnv *env) {
+    globalJVMTIInterface->RawMonitorEnter(monitor_lock);
+    vm_dead = true;
+    store.start_recording = false;
+    for (ThreadContexts::const_iterator iter=thread_contexts.begin(); iter!=thread_contexts.end(); ++iter) {
+        if ((*iter)->exception_pending)
+            send_exception(*iter);
+    }
+    publish_metrics();
+    globalJVMTIInterface->RawMonitorExit(monitor_lock);
+
+    // The pending names go in the queue before it is drained
+    symbolizer.stop();
+
+    globalJVMTIInterface->RawMonitorEnter(unload_lock);
+    inventory_running = false;
+    globalJVMTIInterface->RawMonitorNotify(unload_lock);
+    globalJVMTIInterface->RawMonitorExit(unload_lock);
+
+    globalJVMTIInterface->RawMonitorEnter(flight_lock);
+    flight_running = false;
+    globalJVMTIInterface->RawMonitorNotify(flight_lock);
+    globalJVMTIInterface->RawMonitorExit(flight_lock);
+
+    globalJVMTIInterface->RawMonitorEnter(census_lock);
+    census_running = false;
+    globalJVMTIInterface->RawMonitorNotify(census_lock);
+    globalJVMTIInterface->RawMonitorExit(census_lock);
+
+    cout << "Agent::vm_death- Draining " << store.queue_size() << " events" << endl;
+    store.wait_threads();
+    store.dump(true);
+    journal.close(true);
+}
+
+
+// The JVM aborts on fatal errors (after writing its hs_err file): mark the
+// journal as left by a crash, then let the previous handler (or the default
+// action) run. The journal pages are already in the OS.
+static void fatal_signal(int signal_number) {
+    journal.seal();
+    sigaction(signal_number, &previous_abort_action, 0);
+    raise(signal_number);
+}
+
+
+// The context of a thread goes away with it, but not its last flight events
+static void JNICALL thread_end(jvmtiEnv *jvmti, JNIEnv* jni_env, jthread thread) {
+    globalJVMTIInterface->RawMonitorEnter(monitor_lock);
+    ThreadContext *context = 0;
+    jvmti->GetThreadLocalStorage(thread, reinterpret_cast<void**>(&context));
+
+    if (context) {
+        // Not caught by Java code
+        if (context->exception_pending)
+            send_exception(context);
+
+        // The last events of the thread stay for the next dump, which ends
+        // the thread in the worker once they are drained
+        if (context->flight && !context->flight->empty()) {
+            EndedFlight ended = {context->thread_name, context->thread_no, context->flight};
+            ended_flights.push_back(ended);
+            context->flight = 0;
+            if (ended_flights.size() > FLIGHT_ENDED_THREADS) {
+                send_thread_end(ended_flights.front().thread_name, ended_flights.front().thread_no);
+                delete ended_flights.front().flight;
+                ended_flights.pop_front();
+            }
+        }
+        else
+            send_thread_end(context->thread_name, context->thread_no);
+
+        jvmti->SetThreadLocalStorage(thread, 0);
+        thread_contexts.remove(context);
+        delete context;
+    }
+    globalJVMTIInterface->RawMonitorExit(monitor_lock);
+}
+
+
+// A kept event goes to the worker, or to the flight ring
+static void sink(ThreadContext* context, TraceEvent& e) {
+    if (flight_events) {
+        // Made on the first event: the threads excluded by the filter have a
+        // context but no ring
+        if (!context->flight)
+            context->flight = new FlightRing(flight_events);
+        context->flight->append(e, context->thread_no);
     }
     else {
-        struct stat fileInfo;
-        bool file_exists = stat("/Users/rgaucher/Downloads/Threadfix/stop-recording", &fileInfo) == 0;
-        if (file_exists) {
-            store.start_recording = false;
-            store.dump();
+        e.thread_name = context->thread_name;
+        e.thread_no = context->thread_no;
+        store.push(e);
+    }
+}
+
+
+// Send the buffered events of the transaction of the thread. Their entries
+// carry their stack, in case it was first seen in a discarded transaction.
+static void commit_transaction(ThreadContext* context) {
+    for (vector<JournalRecord>::const_iterator iter=context->transaction_events.begin(); iter!=context->transaction_events.end(); ++iter) {
+        TraceEvent e;
+        fill_event(*iter, e);
+        e.new_stack = e.kind == TRACE_ENTRY;
+        sink(context, e);
+    }
+    context->transaction_events.clear();
+}
+
+
+// A recorded event goes to the journal, and to the sink unless it waits for
+// the end of its transaction
+static void record(ThreadContext* context, TraceEvent& e) {
+    journal.append(e, context->thread_no);
+
+    if (context->transaction_id && tail_sampling() && !context->transaction_spilled) {
+        context->transaction_events.push_back(JournalRecord());
+        fill_record(e, context->thread_no, context->transaction_events.back());
+
+        if (context->transaction_events.size() >= TAIL_MAX_EVENTS) {
+            commit_transaction(context);
+            context->transaction_spilled = true;
+        }
+        return;
+    }
+    sink(context, e);
+}
+
+
+// The trigger frame exited: with tail sampling, the transaction is kept if it
+// is over `tail_latency`, or over the `tail_percentile` of its trigger
+static void close_transaction(ThreadContext* context, jmethodID trigger, const unsigned long long end) {
+    if (tail_sampling()) {
+        unsigned long long latency = end > context->transaction_start ? end - context->transaction_start : 0;
+        LatencyHistogram& latencies = transaction_latencies[trigger];
+        latencies.add(latency);
+
+        bool slow = context->transaction_spilled
+                 || (tail_latency && latency >= tail_latency)
+                 || (tail_percentile > 0 && latency >= latencies.percentile(tail_percentile));
+        if (slow) {
+            commit_transaction(context);
+            tail_kept++;
+        }
+        else {
+            context->transaction_events.clear();
+            tail_discarded++;
         }
+        context->transaction_spilled = false;
     }
+    context->transaction_id = 0;
+}
+
 
-    if (!store.start_recording) {
+static void JNICALL method_exit(jvmtiEnv *jvmti, JNIEnv* jni_env, jthread thread, jmethodID methodId, jboolean exception_raised, jvalue return_value) {
+    globalJVMTIInterface->RawMonitorEnter(monitor_lock);
+    if (vm_dead) {
         globalJVMTIInterface->RawMonitorExit(monitor_lock);
         return;
     }
 
-    // Get name of method
-    string sig, method, clazz, generic_class, thread_name;
+    ThreadContext *context = get_context(jvmti, thread);
+    MethodStack *current_stack = &context->stack;
+
+    // The frame is unwound by the pending exception
+    if (exception_raised && context->exception_pending)
+        context->exception.depth++;
+
+    if (!current_stack->empty()) {
+        unsigned long long trace_id = current_stack->top().trace_id;
+        unsigned long long start = current_stack->top().start;
+        bool trigger = current_stack->top().trigger;
+        current_stack->pop();
+
+        jlong timestamp = 0;
+        if (trace_id || trigger)
+            jvmti->GetTime(&timestamp);
+
+        // Close the interval of the recorded call
+        if (trace_id) {
+            TraceEvent e;
+            e.kind = TRACE_EXIT;
+            e.trace_id = trace_id;
+            e.sequence = ++store.sequence_counter;
+            e.timestamp = timestamp;
+            e.unwound = exception_raised && context->exception_pending;
+            record(context, e);
+
+            if (flight_latency && e.timestamp - start > flight_latency)
+                flight_dump("latency");
+        }
+
+        if (trigger)
+            close_transaction(context, methodId, timestamp);
+    }
+
+    globalJVMTIInterface->RawMonitorExit(monitor_lock);
+}
+
+// Intern the call path made of the path of the caller and the method. Every
+// callback runs under `monitor_lock`, so a single table is shared by all the
+// threads and a path seen on several threads gets a single id
+static unsigned long long get_stack_id(unsigned long long parent_stack_id, jmethodID methodId, bool& new_stack) {
+    std::pair<unsigned long long, jmethodID> key(parent_stack_id, methodId);
+    unsigned long long* stack_id = stack_interning.find(key);
+
+    new_stack = !stack_id;
+    if (!new_stack)
+        return *stack_id;
+
+    return stack_interning.insert(key, ++store.stack_counter);
+}
+
+
+// Have the symbolizer name a method
+static void request_symbol(jvmtiEnv *jvmti, JNIEnv* jni_env, jmethodID methodId, jclass declaring_class) {
+    if (!symbolizer.request(jni_env, methodId, declaring_class)) {
+        // No symbolizer (yet): resolve the names here
+        vector<MethodSymbol> symbols(1);
+        string generic_class;
+        symbols[0].method_id = reinterpret_cast<unsigned long long>(methodId);
+        get_classname(jvmti, declaring_class, symbols[0].class_name, generic_class);
+        get_method(jvmti, methodId, symbols[0].method_name, symbols[0].signature_name);
+        publish_symbols(symbols);
+    }
+}
+
+
+// First call of a method: its verdict comes from the tag of its class and,
+// when it is recorded, the symbolizer gets to name it. No string work here,
+// except for the classes prepared before the agent (see class_tag).
+static MethodVerdict first_call(jvmtiEnv *jvmti, JNIEnv* jni_env, jmethodID methodId) {
+    jclass declaring_class = 0;
+    jvmti->GetMethodDeclaringClass(methodId, &declaring_class);
+
+    jlong tag = class_tag(jvmti, jni_env, declaring_class);
+    MethodVerdict verdict = {ClassHierarchy::tag_index(tag), (tag & CLASS_FILTERED) != 0, false, false};
+
+    // Only the methods of the trigger classes need their name right away
+    if (tag & CLASS_TRIGGER) {
+        string method_name, signature_name;
+        get_method(jvmti, methodId, method_name, signature_name);
+        verdict.trigger = store.trigger(hierarchy.signature(verdict.class_index), method_name);
+    }
+
+    if (verdict.filtered)
+        return verdict;
+
+    request_symbol(jvmti, jni_env, methodId, declaring_class);
+    verdict.named = true;
+    return verdict;
+}
+
+
+// Verdict of a method seen outside of MethodEntry (e.g. a throw site)
+static MethodVerdict& method_verdict(jvmtiEnv *jvmti, JNIEnv* jni_env, jmethodID methodId) {
+    MethodVerdict* verdict = method_verdicts.find(methodId);
+    if (!verdict)
+        verdict = &method_verdicts.insert(methodId, first_call(jvmti, jni_env, methodId));
+    return *verdict;
+}
+
+
+// The sites of the exceptions are named even in the filtered classes, where
+// most of them are thrown
+static void name_site(jvmtiEnv *jvmti, JNIEnv* jni_env, jmethodID methodId) {
+    MethodVerdict& verdict = method_verdict(jvmti, jni_env, methodId);
+    if (verdict.named)
+        return;
+
+    jclass declaring_class = 0;
+    jvmti->GetMethodDeclaringClass(methodId, &declaring_class);
+    request_symbol(jvmti, jni_env, methodId, declaring_class);
+    verdict.named = true;
+}
+
+
+// Are the events of the thread recorded now?
+static bool recording(ThreadContext* context) {
+    return store.has_triggers() ? context->transaction_id != 0 : store.start_recording;
+}
 
-    get_classname(jvmti, methodId, clazz, generic_class);
 
-    // Should we filter out the current class?
-    if (store.filter(clazz)) {
+// Dump information for each entry of method (at each call)
+static void JNICALL method_entry(jvmtiEnv *jvmti, JNIEnv* jni_env, jthread thread, jmethodID methodId) {
+    globalJVMTIInterface->RawMonitorEnter(monitor_lock);
+    if (vm_dead) {
         globalJVMTIInterface->RawMonitorExit(monitor_lock);
         return;
     }
 
-    // Capture if the object is serializable
-    store.compute_serializable(clazz, generic_class);
+    ThreadContext *context = get_context(jvmti, thread);
+    MethodStack *current_stack = &context->stack;
+
+    // Not recorded until proven otherwise: inherit the context of the caller
+    MethodFrame frame = {methodId, 0, 0, 0, 0, false, 0};
+    if (!current_stack->empty()) {
+        frame.context_id = current_stack->top().context_id;
+        frame.stack_id = current_stack->top().stack_id;
+        frame.depth = current_stack->top().depth;
+    }
+    current_stack->push(frame);
+
+
+    // With triggers, the transactions replace the start/stop files
+    if (!store.has_triggers()) {
+        if (!store.start_recording) {
+            struct stat fileInfo;
+            bool file_exists = stat("/Users/rgaucher/Downloads/Threadfix/start-recording", &fileInfo) == 0;
+
+            if (file_exists)
+                store.start_recording = true;
+        }
+        else {
+            struct stat fileInfo;
+            bool file_exists = stat("/Users/rgaucher/Downloads/Threadfix/stop-recording", &fileInfo) == 0;
+            if (file_exists) {
+                store.start_recording = false;
+                store.dump(true);
+            }
+        }
+
+        if (!store.start_recording) {
+            globalJVMTIInterface->RawMonitorExit(monitor_lock);
+            return;
+        }
+    }
 
-    get_metod(jvmti, methodId, method, sig);
-    get_thread(jvmti, thread, thread_name);
+    MethodVerdict* verdict = &method_verdict(jvmti, jni_env, methodId);
+
+    // Outside of a transaction, only a trigger opens one (until it exits)
+    if (store.has_triggers() && !context->transaction_id) {
+        if (!verdict->trigger) {
+            globalJVMTIInterface->RawMonitorExit(monitor_lock);
+            return;
+        }
+        context->transaction_id = ++store.transaction_counter;
+        current_stack->top().trigger = true;
+
+        if (tail_sampling()) {
+            jlong now = 0;
+            jvmti->GetTime(&now);
+            context->transaction_start = now;
+        }
+    }
 
-    store.push(thread_name, clazz, method, sig, 
-               reinterpret_cast<unsigned long long>(methodId), 
-               reinterpret_cast<unsigned long long>(current_stack->top()));
+    if (verdict->filtered) {
+        globalJVMTIInterface->RawMonitorExit(monitor_lock);
+        return;
+    }
+
+    // The call is recorded: it becomes the context of its callees
+    MethodFrame& current_frame = current_stack->top();
+    TraceEvent e;
+    e.kind = TRACE_ENTRY;
+    e.method_id = reinterpret_cast<unsigned long long>(methodId);
+    e.parent_trace_id = current_frame.context_id;
+    e.parent_stack_id = current_frame.stack_id;
+    e.depth = current_frame.depth;
+    e.trace_id = ++store.trace_counter;
+    e.stack_id = get_stack_id(e.parent_stack_id, methodId, e.new_stack);
+    e.sequence = ++store.sequence_counter;
+    e.transaction_id = context->transaction_id;
+
+    current_frame.trace_id = e.trace_id;
+    current_frame.context_id = e.trace_id;
+    current_frame.stack_id = e.stack_id;
+    current_frame.depth = e.depth + 1;
+
+    jlong timestamp = 0;
+    jvmti->GetTime(&timestamp);
+    e.timestamp = timestamp;
+    current_frame.start = timestamp;
+    record(context, e);
+
+    if (0 == (e.sequence & METRICS_PERIOD_MASK))
+        publish_metrics();
     /*
     // Get the parameters
     jint size;
@@ -268,6 +1411,225 @@ static void JNICALL method_entry(jvmtiEnv *jvmti, JNIEnv* jni_env, jthread threa
 
 
 
+// A thrown exception: recorded when the thread records, it waits in the
+// context of the thread for its catch. Also checks the flight recorder
+// exception triggers, a match dumps the rings.
+static void JNICALL vm_exception(jvmtiEnv *jvmti_env, JNIEnv* env, jthread thr, jmethodID method, jlocation location, jobject exception, jmethodID catch_method, jlocation catch_location) {
+    globalJVMTIInterface->RawMonitorEnter(monitor_lock);
+    if (vm_dead) {
+        globalJVMTIInterface->RawMonitorExit(monitor_lock);
+        return;
+    }
+
+    jclass exception_class = env->GetObjectClass(exception);
+    string class_name = hierarchy.signature(ClassHierarchy::tag_index(class_tag(jvmti_env, env, exception_class)));
+    env->DeleteLocalRef(exception_class);
+
+    ThreadContext *context = get_context(jvmti_env, thr);
+    if (record_exceptions && recording(context)) {
+        // Thrown again before being caught by Java code (e.g. cleared by JNI)
+        if (context->exception_pending)
+            send_exception(context);
+
+        name_site(jvmti_env, env, method);
+
+        TraceEvent& e = context->exception;
+        e = TraceEvent();
+        e.kind = TRACE_EXCEPTION;
+        e.class_name = class_name;
+        e.method_id = reinterpret_cast<unsigned long long>(method);
+        e.location = location;
+        e.parent_trace_id = context->stack.empty() ? 0 : context->stack.top().context_id;
+        e.sequence = ++store.sequence_counter;
+        e.transaction_id = context->transaction_id;
+        context->exception_pending = true;
+    }
+
+    for (vector<string>::const_iterator iter=flight_exceptions.begin(); iter!=flight_exceptions.end(); ++iter) {
+        if (class_name.find(*iter) != string::npos) {
+            flight_dump("exception " + class_name);
+            break;
+        }
+    }
+    globalJVMTIInterface->RawMonitorExit(monitor_lock);
+}
+
+
+// The pending exception of the thread is caught: the frames it unwound were
+// counted by method_exit, the catching frame is the top of the stack
+static void JNICALL vm_exception_catch(jvmtiEnv *jvmti_env, JNIEnv* env, jthread thr, jmethodID method, jlocation location, jobject exception) {
+    globalJVMTIInterface->RawMonitorEnter(monitor_lock);
+    if (vm_dead) {
+        globalJVMTIInterface->RawMonitorExit(monitor_lock);
+        return;
+    }
+
+    ThreadContext *context = get_context(jvmti_env, thr);
+    if (context->exception_pending) {
+        name_site(jvmti_env, env, method);
+
+        TraceEvent& e = context->exception;
+        e.catch_method_id = reinterpret_cast<unsigned long long>(method);
+        e.catch_location = location;
+        e.trace_id = context->stack.empty() ? 0 : context->stack.top().context_id;
+        send_exception(context);
+    }
+    globalJVMTIInterface->RawMonitorExit(monitor_lock);
+}
+
+
+// Site of a monitor event or of an allocation: the first frame that is not a
+// method of java/lang/Object (Object.wait and its native helpers, clone)
+static void call_site(jvmtiEnv *jvmti, JNIEnv* jni_env, jthread thread, TraceEvent& e) {
+    static const jint site_frames = 4;
+    jvmtiFrameInfo frames[site_frames];
+    jint count = 0;
+    if (JVMTI_ERROR_NONE != jvmti->GetStackTrace(thread, 0, site_frames, frames, &count))
+        return;
+
+    for (jint i=0; i<count; i++) {
+        jclass declaring_class = 0;
+        jvmti->GetMethodDeclaringClass(frames[i].method, &declaring_class);
+        unsigned int class_index = ClassHierarchy::tag_index(class_tag(jvmti, jni_env, declaring_class));
+        jni_env->DeleteLocalRef(declaring_class);
+
+        if (i + 1 == count || hierarchy.signature(class_index) != "Ljava/lang/Object;") {
+            name_site(jvmti, jni_env, frames[i].method);
+            e.method_id = reinterpret_cast<unsigned long long>(frames[i].method);
+            e.location = frames[i].location;
+            return;
+        }
+    }
+}
+
+
+// The thread blocks on a monitor (contended enter or wait): the blocking is
+// attributed to the current call path and the class of the monitor
+static void block_monitor(jvmtiEnv *jvmti, JNIEnv* jni_env, jthread thread, jobject object, TraceEventKind kind) {
+    globalJVMTIInterface->RawMonitorEnter(monitor_lock);
+    ThreadContext *context = vm_dead ? 0 : get_context(jvmti, thread);
+    if (!context || !recording(context)) {
+        globalJVMTIInterface->RawMonitorExit(monitor_lock);
+        return;
+    }
+
+    TraceEvent& e = context->monitor;
+    e = TraceEvent();
+    e.kind = kind;
+
+    jclass monitor_class = jni_env->GetObjectClass(object);
+    e.class_name = hierarchy.signature(ClassHierarchy::tag_index(class_tag(jvmti, jni_env, monitor_class)));
+    jni_env->DeleteLocalRef(monitor_class);
+
+    call_site(jvmti, jni_env, thread, e);
+    if (!context->stack.empty()) {
+        e.trace_id = context->stack.top().context_id;
+        e.stack_id = context->stack.top().stack_id;
+    }
+    e.transaction_id = context->transaction_id;
+
+    jlong now = 0;
+    jvmti->GetTime(&now);
+    e.timestamp = now;
+    context->monitor_pending = true;
+    globalJVMTIInterface->RawMonitorExit(monitor_lock);
+}
+
+
+// The thread got the monitor (or was notified): send the blocked time
+static void unblock_monitor(jvmtiEnv *jvmti, jthread thread) {
+    globalJVMTIInterface->RawMonitorEnter(monitor_lock);
+    ThreadContext *context = vm_dead ? 0 : get_context(jvmti, thread);
+    if (context && context->monitor_pending) {
+        jlong now = 0;
+        jvmti->GetTime(&now);
+
+        TraceEvent& e = context->monitor;
+        e.sequence = static_cast<unsigned long long>(now) > e.timestamp ? now - e.timestamp : 0;
+        e.thread_name = context->thread_name;
+        e.thread_no = context->thread_no;
+        store.push(e);
+        context->monitor_pending = false;
+        monitor_events++;
+    }
+    globalJVMTIInterface->RawMonitorExit(monitor_lock);
+}
+
+
+static void JNICALL monitor_contended_enter(jvmtiEnv *jvmti, JNIEnv* jni_env, jthread thread, jobject object) {
+    block_monitor(jvmti, jni_env, thread, object, TRACE_MONITOR_ENTER);
+}
+
+
+static void JNICALL monitor_contended_entered(jvmtiEnv *jvmti, JNIEnv* jni_env, jthread thread, jobject object) {
+    unblock_monitor(jvmti, thread);
+}
+
+
+static void JNICALL monitor_wait(jvmtiEnv *jvmti, JNIEnv* jni_env, jthread thread, jobject object, jlong timeout) {
+    block_monitor(jvmti, jni_env, thread, object, TRACE_MONITOR_WAIT);
+}
+
+
+static void JNICALL monitor_waited(jvmtiEnv *jvmti, JNIEnv* jni_env, jthread thread, jobject object, jboolean timed_out) {
+    unblock_monitor(jvmti, thread);
+}
+
+
+// An allocation sample, attributed to its site, the current call path and
+// the allocated class (caller holds `monitor_lock`)
+static void sample_allocation(jvmtiEnv *jvmti, JNIEnv* jni_env, jthread thread, ThreadContext* context, jclass object_klass, jlong size) {
+    TraceEvent e;
+    e.kind = TRACE_ALLOCATION;
+    e.class_name = hierarchy.signature(ClassHierarchy::tag_index(class_tag(jvmti, jni_env, object_klass)));
+    e.size = size;
+
+    call_site(jvmti, jni_env, thread, e);
+    if (!context->stack.empty()) {
+        e.trace_id = context->stack.top().context_id;
+        e.stack_id = context->stack.top().stack_id;
+    }
+    e.transaction_id = context->transaction_id;
+
+    jlong now = 0;
+    jvmti->GetTime(&now);
+    e.timestamp = now;
+    e.thread_name = context->thread_name;
+    e.thread_no = context->thread_no;
+    store.push(e);
+    allocation_samples++;
+}
+
+
+#ifdef USE_SAMPLED_ALLOCATION
+// The JVM picked the allocation, about one every `allocation_interval` bytes
+static void JNICALL sampled_object_alloc(jvmtiEnv *jvmti, JNIEnv* jni_env, jthread thread, jobject object, jclass object_klass, jlong size) {
+    globalJVMTIInterface->RawMonitorEnter(monitor_lock);
+    ThreadContext *context = vm_dead ? 0 : get_context(jvmti, thread);
+    if (context && recording(context))
+        sample_allocation(jvmti, jni_env, thread, context, object_klass, size);
+    globalJVMTIInterface->RawMonitorExit(monitor_lock);
+}
+#endif
+
+
+// Fallback of the JVMs without SampledObjectAlloc: only the objects allocated
+// by the VM itself (JNI, reflection, ...) are seen, and the allocation that
+// crosses each `allocation_interval` bytes of a thread is the sample
+static void JNICALL vm_object_alloc(jvmtiEnv *jvmti, JNIEnv* jni_env, jthread thread, jobject object, jclass object_klass, jlong size) {
+    globalJVMTIInterface->RawMonitorEnter(monitor_lock);
+    ThreadContext *context = vm_dead ? 0 : get_context(jvmti, thread);
+    if (context && recording(context)) {
+        context->allocated_bytes += size;
+        if (context->allocated_bytes >= allocation_interval) {
+            context->allocated_bytes %= allocation_interval;
+            sample_allocation(jvmti, jni_env, thread, context, object_klass, size);
+        }
+    }
+    globalJVMTIInterface->RawMonitorExit(monitor_lock);
+}
+
+
 // Agent start method
 // Create the capabilities, and associate the callbacks for VM_INIT, and METHOD_ENTRY
 JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *jvm, char *options, void *reserved) {
@@ -289,12 +1651,129 @@ JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *jvm, char *options, void *reserved)
         if (conf.find("filters") != conf.end())
             store.load_filter(conf.at("filters"));
 
+        // Only trace the threads matching the patterns
+        if (conf.find("threads") != conf.end())
+            store.load_thread_filter(conf.at("threads"));
+
+        // Record the calls made under the trigger methods only
+        if (conf.find("triggers") != conf.end())
+            store.load_triggers(conf.at("triggers"));
+
         // Give the database location
         if (conf.find("database") != conf.end())
             store.set_database(conf.at("database"));
 
+        // Record every call (trace) or only aggregate them (cct, edges)
+        if (conf.find("mode") != conf.end())
+            store.set_mode(conf.at("mode"));
+
+        // Fold the repeated subtrees, keeping at most `fold` pending rows per call
+        if (conf.find("fold") != conf.end())
+            store.set_fold_window(conf.at("fold"));
+
+        // Flight recorder: keep the last `flight` events of each thread in
+        // memory, and only save them when a trigger fires
+        if (conf.find("flight") != conf.end())
+            flight_events = strtoul(conf.at("flight").c_str(), 0, 10);
+
+        if (conf.find("flight_latency") != conf.end())
+            flight_latency = strtoull(conf.at("flight_latency").c_str(), 0, 10) * 1000000ULL;
+
+        if (conf.find("flight_exceptions") != conf.end())
+            boost::split(flight_exceptions, conf.at("flight_exceptions"), boost::is_any_of(":"));
+
+        if (conf.find("flight_control") != conf.end())
+            flight_control = conf.at("flight_control");
+
+        // Tail sampling: only keep the transactions slower than
+        // `tail_latency` ms, or than the `tail_percentile` of their trigger
+        if (conf.find("tail_latency") != conf.end())
+            tail_latency = strtoull(conf.at("tail_latency").c_str(), 0, 10) * 1000000ULL;
+
+        if (conf.find("tail_percentile") != conf.end())
+            tail_percentile = strtod(conf.at("tail_percentile").c_str(), 0);
+
+        // Record the thrown exceptions, with their catch site
+        if (conf.find("exceptions") != conf.end())
+            record_exceptions = strtoul(conf.at("exceptions").c_str(), 0, 10) != 0;
+
+        // Record the time blocked on the monitors, per site and call path
+        if (conf.find("monitors") != conf.end())
+            record_monitors = strtoul(conf.at("monitors").c_str(), 0, 10) != 0;
+
+        // Sample the allocations, one every `allocations` bytes (0 for the default)
+        if (conf.find("allocations") != conf.end()) {
+            allocation_interval = strtoull(conf.at("allocations").c_str(), 0, 10);
+            if (!allocation_interval)
+                allocation_interval = ALLOCATION_INTERVAL;
+            // SetHeapSamplingInterval takes a jint
+            if (allocation_interval > INT_MAX)
+                allocation_interval = INT_MAX;
+        }
+
+        // Heap census every `heap_census` s (0: only on DataDumpRequest)
+        if (conf.find("heap_census") != conf.end()) {
+            heap_census_enabled = true;
+            heap_census_period = strtoull(conf.at("heap_census").c_str(), 0, 10) * 1000ULL;
+        }
+
+        // Retention paths of `retention_paths` samples of each leak suspect
+        // of the censuses
+        if (conf.find("retention_paths") != conf.end()) {
+            retention_samples = strtoul(conf.at("retention_paths").c_str(), 0, 10);
+            if (!retention_samples)
+                retention_samples = RETENTION_PATH_SAMPLES;
+            if (!heap_census_enabled)
+                cout << "Agent::Agent_OnLoad- retention_paths needs heap_census, no retention paths" << endl;
+        }
+
+        // Keep the last `journal_records` events in a crash journal
+        if (conf.find("journal") != conf.end()) {
+            unsigned long long records = JOURNAL_RECORDS;
+            if (conf.find("journal_records") != conf.end())
+                records = strtoull(conf.at("journal_records").c_str(), 0, 10);
+
+            if (journal.open(conf.at("journal"), records)) {
+                struct sigaction action;
+                memset(&action, 0, sizeof(action));
+                action.sa_handler = &fatal_signal;
+                sigemptyset(&action.sa_mask);
+                sigaction(SIGABRT, &action, &previous_abort_action);
+            }
+        }
+    }
+
+    if (tail_sampling() && !store.has_triggers()) {
+        cout << "Agent::Agent_OnLoad- Tail sampling needs triggers, every call is recorded" << endl;
+        tail_latency = 0;
+        tail_percentile = 0;
+    }
+
+    // The rings only hold the rows of the calls: no aggregation or folding
+    if (flight_events) {
+        if (store.mode != MODE_TRACE || store.fold_window)
+            cout << "Agent::Agent_OnLoad- The flight recorder records the calls, the mode and fold options are ignored" << endl;
+        store.mode = MODE_TRACE;
+        store.fold_window = 0;
+
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = &flight_signal;
+        sigemptyset(&action.sa_mask);
+        sigaction(FLIGHT_SIGNAL, &action, 0);
+    }
+    else {
+        // No rings to dump
+        flight_latency = 0;
+        flight_exceptions.clear();
     }
 
+    // Bound the memory of the caches, `cache_budget` is in MB
+    size_t cache_budget = CACHE_BUDGET_MB;
+    if (conf.find("cache_budget") != conf.end())
+        cache_budget = strtoul(conf.at("cache_budget").c_str(), 0, 10);
+    set_cache_budget(cache_budget * 1024 * 1024);
+
     jint returnCode = jvm->GetEnv((void **)&globalJVMTIInterface, JVMTI_VERSION_1_1);
     
     if (returnCode != JNI_OK) {
@@ -315,10 +1794,38 @@ JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *jvm, char *options, void *reserved)
     capabilities.can_get_source_file_name = 1;
     capabilities.can_signal_thread = 1;
     capabilities.can_tag_objects = 1;
+    capabilities.can_generate_object_free_events = 1;
+    capabilities.can_generate_exception_events = (record_exceptions || !flight_exceptions.empty()) ? 1 : 0;
+    capabilities.can_generate_monitor_events = record_monitors ? 1 : 0;
+
+    // The sampled allocations when the JVM has them, VMObjectAlloc otherwise
+    if (allocation_interval) {
+        jvmtiCapabilities potential;
+        memset(&potential, 0, sizeof(potential));
+        globalJVMTIInterface->GetPotentialCapabilities(&potential);
+#ifdef USE_SAMPLED_ALLOCATION
+        sampled_allocations = potential.can_generate_sampled_object_alloc_events;
+        capabilities.can_generate_sampled_object_alloc_events = sampled_allocations ? 1 : 0;
+#endif
+        if (!sampled_allocations) {
+            cout << "Agent::Agent_OnLoad- No sampled allocations, only the allocations of the VM (VMObjectAlloc) are sampled" << endl;
+            capabilities.can_generate_vm_object_alloc_events = 1;
+        }
+    }
 
     // Add our capabilities to the env
     globalJVMTIInterface->AddCapabilities(&capabilities);
 
+#ifdef USE_SAMPLED_ALLOCATION
+    if (sampled_allocations) {
+        jvmtiError error = globalJVMTIInterface->SetHeapSamplingInterval(static_cast<jint>(allocation_interval));
+        if (JVMTI_ERROR_NONE != error) {
+            cout << "Agent::Agent_OnLoad- SetHeapSamplingInterval failed: " << error << ", the JVM samples every " << ALLOCATION_INTERVAL << " bytes" << endl;
+            allocation_interval = ALLOCATION_INTERVAL;
+        }
+    }
+#endif
+
 
     memset(&eventCallbacks, 0, sizeof(eventCallbacks));
     eventCallbacks.VMInit = &vm_init;
@@ -326,15 +1833,57 @@ JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *jvm, char *options, void *reserved)
     eventCallbacks.MethodExit = &method_exit;
     eventCallbacks.VMDeath = &vm_death;
     eventCallbacks.Exception = &vm_exception;
+    eventCallbacks.ExceptionCatch = &vm_exception_catch;
+    eventCallbacks.MonitorContendedEnter = &monitor_contended_enter;
+    eventCallbacks.MonitorContendedEntered = &monitor_contended_entered;
+    eventCallbacks.MonitorWait = &monitor_wait;
+    eventCallbacks.MonitorWaited = &monitor_waited;
+    eventCallbacks.VMObjectAlloc = &vm_object_alloc;
+    eventCallbacks.DataDumpRequest = &data_dump_request;
+#ifdef USE_SAMPLED_ALLOCATION
+    eventCallbacks.SampledObjectAlloc = &sampled_object_alloc;
+#endif
+    eventCallbacks.ClassPrepare = &class_prepare;
+    eventCallbacks.ObjectFree = &object_free;
+    eventCallbacks.ThreadStart = &thread_start;
+    eventCallbacks.ThreadEnd = &thread_end;
 
     globalJVMTIInterface->SetEventCallbacks(&eventCallbacks, (jint)sizeof(eventCallbacks));
     globalJVMTIInterface->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_INIT, (jthread)0);
     globalJVMTIInterface->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_DEATH, (jthread)0);
-    globalJVMTIInterface->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_METHOD_ENTRY, (jthread)0);
-    globalJVMTIInterface->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_METHOD_EXIT, (jthread)0);
-    globalJVMTIInterface->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_EXCEPTION, (jthread)0);
+    // With a thread filter, the method events are enabled thread by thread
+    // (see select_thread): a global enable would reach every thread
+    if (!store.has_thread_filter()) {
+        globalJVMTIInterface->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_METHOD_ENTRY, (jthread)0);
+        globalJVMTIInterface->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_METHOD_EXIT, (jthread)0);
+    }
+    globalJVMTIInterface->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_THREAD_START, (jthread)0);
+    if (!store.has_thread_filter()) {
+        if (record_exceptions || !flight_exceptions.empty())
+            globalJVMTIInterface->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_EXCEPTION, (jthread)0);
+        if (record_exceptions)
+            globalJVMTIInterface->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_EXCEPTION_CATCH, (jthread)0);
+        if (record_monitors) {
+            globalJVMTIInterface->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_MONITOR_CONTENDED_ENTER, (jthread)0);
+            globalJVMTIInterface->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_MONITOR_CONTENDED_ENTERED, (jthread)0);
+            globalJVMTIInterface->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_MONITOR_WAIT, (jthread)0);
+            globalJVMTIInterface->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_MONITOR_WAITED, (jthread)0);
+        }
+        if (allocation_interval)
+            globalJVMTIInterface->SetEventNotificationMode(JVMTI_ENABLE, allocation_event(), (jthread)0);
+    }
+    globalJVMTIInterface->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_CLASS_PREPARE, (jthread)0);
+    globalJVMTIInterface->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_OBJECT_FREE, (jthread)0);
+    globalJVMTIInterface->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_THREAD_END, (jthread)0);
+    if (heap_census_enabled)
+        globalJVMTIInterface->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_DATA_DUMP_REQUEST, (jthread)0);
 
     globalJVMTIInterface->CreateRawMonitor("agent data", &monitor_lock);
+    globalJVMTIInterface->CreateRawMonitor("unloaded classes", &unload_lock);
+    globalJVMTIInterface->CreateRawMonitor("flight recorder", &flight_lock);
+    globalJVMTIInterface->CreateRawMonitor("heap census", &census_lock);
+
+    serializable_bit = hierarchy.interface_bit("Ljava/io/Serializable;");
 
     return JVMTI_ERROR_NONE;
 }
@@ -344,13 +1893,16 @@ JNIEXPORT void JNICALL Agent_OnUnload(JavaVM *jvm) {
     cout << "Agent::Agent_OnUnload- End of the tracing, dumping the database..." << endl;
     cout << "Agent::Agent_OnUnload- Number of messages remaining for processing " << store.queue_size() << endl;
 
-    // Make sure we dump everything...
-    store.wait_threads();
-    store.dump();
+    // Make sure we dump everything... unless VMDeath already did
+    if (!vm_dead) {
+        store.wait_threads();
+        store.dump(true);
+        journal.close(true);
+    }
 
     // Clean our stacks
-    for (StackThreadMethod::iterator iter=thread_methodid_stack.begin(); iter!=thread_methodid_stack.end(); ++iter) {
-        delete iter->second;
+    for (ThreadContexts::iterator iter=thread_contexts.begin(); iter!=thread_contexts.end(); ++iter) {
+        delete *iter;
     }
 
 }
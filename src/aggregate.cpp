@@ -0,0 +1,633 @@
+/*
+  Java JVMTI Trace Extraction
+  by Romain Gaucher <r@rgaucher.info> - http://rgaucher.info
+
+  Copyright (c) 2011-2012 Romain Gaucher <r@rgaucher.info>
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#include <algorithm>
+#include "aggregate.h"
+
+using namespace std;
+
+
+CallingContextTree::~CallingContextTree() {
+    release(&root);
+}
+
+
+void CallingContextTree::release(CallingContextNode* node) {
+    for (map<unsigned long long, CallingContextNode*>::iterator iter=node->children.begin(); iter!=node->children.end(); ++iter) {
+        release(iter->second);
+        delete iter->second;
+    }
+    node->children.clear();
+}
+
+
+void CallingContextTree::enter(const unsigned long long fqn_id, const unsigned long long timestamp, unsigned long long& next_node_id) {
+    CallingContextNode* parent = open_calls.empty() ? &root : open_calls.back().node;
+    CallingContextNode* node = 0;
+
+    map<unsigned long long, CallingContextNode*>::const_iterator iter = parent->children.find(fqn_id);
+    if (iter == parent->children.end()) {
+        node = new CallingContextNode(++next_node_id, parent->id, fqn_id, open_calls.size());
+        parent->children[fqn_id] = node;
+    }
+    else
+        node = iter->second;
+
+    node->calls++;
+    node->dirty = true;
+
+    OpenCall call = {node, timestamp, 0};
+    open_calls.push_back(call);
+}
+
+
+void CallingContextTree::exit(const unsigned long long timestamp) {
+    if (open_calls.empty())
+        return;
+
+    OpenCall call = open_calls.back();
+    open_calls.pop_back();
+
+    unsigned long long duration = timestamp > call.start ? timestamp - call.start : 0;
+    call.node->total_time += duration;
+    call.node->self_time += duration > call.children_time ? duration - call.children_time : 0;
+    call.node->dirty = true;
+
+    if (!open_calls.empty())
+        open_calls.back().children_time += duration;
+}
+
+
+void CallingContextTree::flush(db::Database& database) {
+    flush(database, &root);
+}
+
+
+void CallingContextTree::flush(db::Database& database, CallingContextNode* node) {
+    if (node->dirty) {
+        database.cct_node(node->id, thread_id, node->parent_id, node->fqn_id, node->depth,
+                          node->calls, node->total_time, node->self_time);
+        node->dirty = false;
+    }
+
+    for (map<unsigned long long, CallingContextNode*>::const_iterator iter=node->children.begin(); iter!=node->children.end(); ++iter) {
+        flush(database, iter->second);
+    }
+}
+
+
+void CallGraph::enter(const unsigned int thread_no, const string& group, const unsigned long long fqn_id, const unsigned long long timestamp) {
+    ThreadCalls& thread = open_calls[thread_no];
+    vector<OpenCall>& thread_calls = thread.calls;
+    unsigned long long caller_fqn_id = thread_calls.empty() ? 0 : thread_calls.back().fqn_id;
+
+    TupleEdge key(caller_fqn_id, fqn_id, group);
+    map<TupleEdge, CallEdge>::iterator iter = edges.find(key);
+    if (iter == edges.end()) {
+        CallEdge edge = {++edge_counter, 0, 0, false};
+        iter = edges.insert(make_pair(key, edge)).first;
+    }
+
+    CallEdge* edge = &iter->second;
+    edge->calls++;
+    edge->dirty = true;
+
+    OpenCall call = {fqn_id, edge, timestamp};
+    thread_calls.push_back(call);
+    thread.active[edge]++;
+}
+
+
+void CallGraph::exit(const unsigned int thread_no, const unsigned long long timestamp) {
+    ThreadCalls& thread = open_calls[thread_no];
+    vector<OpenCall>& thread_calls = thread.calls;
+    if (thread_calls.empty())
+        return;
+
+    OpenCall call = thread_calls.back();
+    thread_calls.pop_back();
+
+    // The outermost activation covers the time of the nested ones
+    map<CallEdge*, unsigned int>::iterator active = thread.active.find(call.edge);
+    if (--active->second)
+        return;
+    thread.active.erase(active);
+
+    call.edge->total_time += timestamp > call.start ? timestamp - call.start : 0;
+    call.edge->dirty = true;
+}
+
+
+void CallGraph::thread_end(const unsigned int thread_no) {
+    open_calls.erase(thread_no);
+}
+
+
+void CallGraph::flush(db::Database& database) {
+    for (map<TupleEdge, CallEdge>::iterator iter=edges.begin(); iter!=edges.end(); ++iter) {
+        CallEdge& edge = iter->second;
+        if (!edge.dirty)
+            continue;
+
+        database.edge(edge.id, iter->first.get<0>(), iter->first.get<1>(), iter->first.get<2>(), edge.calls, edge.total_time);
+        edge.dirty = false;
+    }
+}
+
+
+void CallSummaries::hit(const unsigned long long key_id, const unsigned long long sequence) {
+    map<unsigned long long, CallSummary>::iterator iter = summaries.find(key_id);
+    if (iter == summaries.end()) {
+        CallSummary summary = {0, sequence, sequence, false};
+        iter = summaries.insert(make_pair(key_id, summary)).first;
+    }
+
+    CallSummary& summary = iter->second;
+    summary.calls++;
+    summary.last_seq = sequence;
+    summary.dirty = true;
+}
+
+
+void CallSummaries::merge(const unsigned long long key_id, const CallSummary& calls) {
+    map<unsigned long long, CallSummary>::iterator iter = summaries.find(key_id);
+    if (iter == summaries.end()) {
+        iter = summaries.insert(make_pair(key_id, calls)).first;
+    }
+    else {
+        CallSummary& summary = iter->second;
+        summary.calls += calls.calls;
+        summary.first_seq = min(summary.first_seq, calls.first_seq);
+        summary.last_seq = max(summary.last_seq, calls.last_seq);
+    }
+    iter->second.dirty = true;
+}
+
+
+const CallSummary* CallSummaries::find(const unsigned long long key_id) const {
+    map<unsigned long long, CallSummary>::const_iterator iter = summaries.find(key_id);
+    if (iter == summaries.end())
+        return 0;
+    return &iter->second;
+}
+
+
+void CallSummaries::flush(db::Database& database, const db::SummaryKind kind) {
+    for (map<unsigned long long, CallSummary>::iterator iter=summaries.begin(); iter!=summaries.end(); ++iter) {
+        CallSummary& summary = iter->second;
+        if (!summary.dirty)
+            continue;
+
+        database.summary(kind, iter->first, summary.calls, summary.first_seq, summary.last_seq);
+        summary.dirty = false;
+    }
+}
+
+
+void ExceptionSummaries::hit(const unsigned long long throw_fqn_id, const long long throw_location, const unsigned long long class_id,
+                             const bool caught, const unsigned int frames_unwound) {
+    TupleThrowSite key(throw_fqn_id, throw_location, class_id);
+    map<TupleThrowSite, ExceptionSummary>::iterator iter = summaries.find(key);
+    if (iter == summaries.end()) {
+        ExceptionSummary summary = {0, 0, 0, false};
+        iter = summaries.insert(make_pair(key, summary)).first;
+    }
+
+    ExceptionSummary& summary = iter->second;
+    summary.throws++;
+    if (caught)
+        summary.caught++;
+    summary.frames_unwound += frames_unwound;
+    summary.dirty = true;
+}
+
+
+void ExceptionSummaries::flush(db::Database& database) {
+    for (map<TupleThrowSite, ExceptionSummary>::iterator iter=summaries.begin(); iter!=summaries.end(); ++iter) {
+        ExceptionSummary& summary = iter->second;
+        if (!summary.dirty)
+            continue;
+
+        database.exception_summary(iter->first.get<0>(), iter->first.get<1>(), iter->first.get<2>(),
+                                   summary.throws, summary.caught, summary.frames_unwound);
+        summary.dirty = false;
+    }
+}
+
+
+static void block(MonitorBlocking& blocking, const unsigned long long blocked_time) {
+    blocking.events++;
+    blocking.blocked_time += blocked_time;
+    blocking.max_blocked_time = max(blocking.max_blocked_time, blocked_time);
+    blocking.dirty = true;
+}
+
+
+void MonitorContention::hit(const unsigned long long site_fqn_id, const long long site_location, const unsigned long long stack_id,
+                            const unsigned long long class_id, const bool wait, const unsigned long long blocked_time) {
+    MonitorBlocking empty = {0, 0, 0, false};
+
+    TupleLockSite site(site_fqn_id, site_location, class_id, wait);
+    map<TupleLockSite, MonitorBlocking>::iterator site_iter = sites.find(site);
+    if (site_iter == sites.end())
+        site_iter = sites.insert(make_pair(site, empty)).first;
+    block(site_iter->second, blocked_time);
+
+    TupleLockStack stack(stack_id, class_id, wait);
+    map<TupleLockStack, MonitorBlocking>::iterator stack_iter = stacks.find(stack);
+    if (stack_iter == stacks.end())
+        stack_iter = stacks.insert(make_pair(stack, empty)).first;
+    block(stack_iter->second, blocked_time);
+}
+
+
+void MonitorContention::flush(db::Database& database) {
+    for (map<TupleLockSite, MonitorBlocking>::iterator iter=sites.begin(); iter!=sites.end(); ++iter) {
+        MonitorBlocking& blocking = iter->second;
+        if (!blocking.dirty)
+            continue;
+
+        database.monitor_site(iter->first.get<0>(), iter->first.get<1>(), iter->first.get<2>(), iter->first.get<3>(),
+                              blocking.events, blocking.blocked_time, blocking.max_blocked_time);
+        blocking.dirty = false;
+    }
+
+    for (map<TupleLockStack, MonitorBlocking>::iterator iter=stacks.begin(); iter!=stacks.end(); ++iter) {
+        MonitorBlocking& blocking = iter->second;
+        if (!blocking.dirty)
+            continue;
+
+        database.monitor_stack(iter->first.get<0>(), iter->first.get<1>(), iter->first.get<2>(),
+                               blocking.events, blocking.blocked_time, blocking.max_blocked_time);
+        blocking.dirty = false;
+    }
+}
+
+
+static void sample(AllocationSamples& samples, const unsigned long long size) {
+    samples.samples++;
+    samples.bytes += size;
+    samples.dirty = true;
+}
+
+
+void AllocationSummaries::hit(const unsigned long long site_fqn_id, const long long site_location, const unsigned long long stack_id,
+                              const unsigned long long class_id, const unsigned long long size) {
+    AllocationSamples empty = {0, 0, false};
+
+    TupleAllocationSite site(site_fqn_id, site_location, class_id);
+    map<TupleAllocationSite, AllocationSamples>::iterator site_iter = sites.find(site);
+    if (site_iter == sites.end())
+        site_iter = sites.insert(make_pair(site, empty)).first;
+    sample(site_iter->second, size);
+
+    TupleAllocationStack stack(stack_id, class_id);
+    map<TupleAllocationStack, AllocationSamples>::iterator stack_iter = stacks.find(stack);
+    if (stack_iter == stacks.end())
+        stack_iter = stacks.insert(make_pair(stack, empty)).first;
+    sample(stack_iter->second, size);
+}
+
+
+void AllocationSummaries::flush(db::Database& database) {
+    for (map<TupleAllocationSite, AllocationSamples>::iterator iter=sites.begin(); iter!=sites.end(); ++iter) {
+        AllocationSamples& samples = iter->second;
+        if (!samples.dirty)
+            continue;
+
+        database.allocation_site(iter->first.get<0>(), iter->first.get<1>(), iter->first.get<2>(), samples.samples, samples.bytes);
+        samples.dirty = false;
+    }
+
+    for (map<TupleAllocationStack, AllocationSamples>::iterator iter=stacks.begin(); iter!=stacks.end(); ++iter) {
+        AllocationSamples& samples = iter->second;
+        if (!samples.dirty)
+            continue;
+
+        database.allocation_stack(iter->first.get<0>(), iter->first.get<1>(), samples.samples, samples.bytes);
+        samples.dirty = false;
+    }
+}
+
+
+// Values under 16 get a bucket each, then each power of two 2^e is split in
+// 16 buckets of width 2^(e-4)
+static const unsigned int histogram_sub_bits = 4;
+static const unsigned long long histogram_sub_buckets = 1ULL << histogram_sub_bits;
+
+size_t LatencyHistogram::bucket(const unsigned long long value) {
+    if (value < histogram_sub_buckets)
+        return static_cast<size_t>(value);
+
+    unsigned int exponent = 63 - __builtin_clzll(value);
+    unsigned long long sub = (value >> (exponent - histogram_sub_bits)) & (histogram_sub_buckets - 1);
+    return static_cast<size_t>((exponent - histogram_sub_bits + 1) * histogram_sub_buckets + sub);
+}
+
+
+unsigned long long LatencyHistogram::bucket_low(const size_t bucket) {
+    if (bucket < histogram_sub_buckets)
+        return bucket;
+
+    unsigned int exponent = bucket / histogram_sub_buckets + histogram_sub_bits - 1;
+    unsigned long long sub = bucket % histogram_sub_buckets;
+    return (histogram_sub_buckets + sub) << (exponent - histogram_sub_bits);
+}
+
+
+unsigned long long LatencyHistogram::bucket_high(const size_t bucket) {
+    if (bucket < histogram_sub_buckets)
+        return bucket;
+
+    unsigned int exponent = bucket / histogram_sub_buckets + histogram_sub_bits - 1;
+    return bucket_low(bucket) + (1ULL << (exponent - histogram_sub_bits)) - 1;
+}
+
+
+// Grow the allocated range of buckets to [low, high]
+void LatencyHistogram::cover(const size_t low, const size_t high) {
+    if (counts.empty()) {
+        first = low;
+        counts.resize(high - low + 1, 0);
+        return;
+    }
+
+    if (low < first) {
+        counts.insert(counts.begin(), first - low, 0);
+        first = low;
+    }
+    if (high >= first + counts.size())
+        counts.resize(high - first + 1, 0);
+}
+
+
+void LatencyHistogram::add(const unsigned long long value) {
+    size_t index = bucket(value);
+    cover(index, index);
+
+    counts[index - first]++;
+    total++;
+    max_value = max(max_value, value);
+}
+
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+    if (other.counts.empty())
+        return;
+
+    cover(other.first, other.first + other.counts.size() - 1);
+    for (size_t i=0; i<other.counts.size(); i++) {
+        counts[other.first - first + i] += other.counts[i];
+    }
+    total += other.total;
+    max_value = max(max_value, other.max_value);
+}
+
+
+unsigned long long LatencyHistogram::percentile(const double percent) const {
+    if (!total)
+        return 0;
+
+    unsigned long long rank = static_cast<unsigned long long>(percent / 100.0 * total + 0.5);
+    rank = max(1ULL, min(rank, total));
+
+    unsigned long long seen = 0;
+    for (size_t i=0; i<counts.size(); i++) {
+        seen += counts[i];
+        if (seen >= rank)
+            return min(bucket_high(first + i), max_value);
+    }
+    return max_value;
+}
+
+
+void MethodLatencies::enter(const unsigned int thread_no, const string& group, const unsigned long long fqn_id,
+                            const unsigned long long trace_id, const unsigned long long timestamp) {
+    Latencies& entry = latencies[TupleLatency(fqn_id, group)];
+    OpenCall call = {trace_id, &entry.histogram, &entry.dirty, timestamp};
+    open_calls[thread_no].push_back(call);
+}
+
+
+void MethodLatencies::exit(const unsigned int thread_no, const unsigned long long trace_id, const unsigned long long timestamp) {
+    vector<OpenCall>& thread_calls = open_calls[thread_no];
+
+    // The calls above the exited one lost their exit
+    for (size_t i=thread_calls.size(); i>0; i--) {
+        if (thread_calls[i - 1].trace_id != trace_id)
+            continue;
+
+        OpenCall& call = thread_calls[i - 1];
+        call.histogram->add(timestamp > call.start ? timestamp - call.start : 0);
+        *call.dirty = true;
+        thread_calls.resize(i - 1);
+        return;
+    }
+}
+
+
+void MethodLatencies::thread_end(const unsigned int thread_no) {
+    open_calls.erase(thread_no);
+}
+
+
+void MethodLatencies::flush(db::Database& database) {
+    for (map<TupleLatency, Latencies>::iterator iter=latencies.begin(); iter!=latencies.end(); ++iter) {
+        Latencies& entry = iter->second;
+        if (!entry.dirty)
+            continue;
+
+        const vector<unsigned long long>& counts = entry.histogram.bucket_counts();
+        for (size_t i=0; i<counts.size(); i++) {
+            if (!counts[i])
+                continue;
+
+            size_t bucket = entry.histogram.first_bucket() + i;
+            database.latency_bucket(iter->first.get<0>(), iter->first.get<1>(), bucket,
+                                    LatencyHistogram::bucket_low(bucket), LatencyHistogram::bucket_high(bucket), counts[i]);
+        }
+        entry.dirty = false;
+    }
+}
+
+
+// Signature of a subtree: FNV-1a over the fqn of the call and the
+// (signature, repeat count) of the runs of its callees
+static const unsigned long long signature_basis = 14695981039346656037ULL;
+
+static unsigned long long signature_mix(unsigned long long signature, unsigned long long value) {
+    for (unsigned int i=0; i<sizeof(value); i++) {
+        signature ^= (value >> (i * 8)) & 0xff;
+        signature *= 1099511628211ULL;
+    }
+    return signature ? signature : 1;
+}
+
+
+SubtreeFolder::SubtreeFolder(unsigned long long _thread_id, size_t _window)
+ : thread_id(_thread_id), window(_window) {
+    OpenCall root;
+    root.row.trace_id = 0;
+    root.last_child = 0;
+    root.last_signature = 0;
+    root.signature = signature_basis;
+    root.written = true;
+    root.pinned = true;
+    open_calls.push_back(root);
+}
+
+
+void SubtreeFolder::enter(const TraceRow& row) {
+    open_calls.push_back(OpenCall());
+
+    OpenCall& call = open_calls.back();
+    call.row = row;
+    call.row.repeat_count = 1;
+    call.last_child = 0;
+    call.last_signature = 0;
+    call.signature = signature_mix(signature_mix(signature_basis, row.fqn_id), row.transaction_id);
+    call.written = false;
+    call.pinned = false;
+}
+
+
+// Pin an open call and its callers (the callers of a pinned call are pinned)
+void SubtreeFolder::pin(const size_t open_call) {
+    for (size_t i=open_call; i>0 && !open_calls[i].pinned; i--) {
+        open_calls[i].pinned = true;
+    }
+}
+
+
+void SubtreeFolder::pin(const unsigned long long trace_id) {
+    if (!trace_id)
+        return;
+
+    for (size_t i=open_calls.size(); i>1; i--) {
+        if (open_calls[i - 1].row.trace_id == trace_id) {
+            pin(i - 1);
+            return;
+        }
+    }
+}
+
+
+void SubtreeFolder::close_run(OpenCall& call) {
+    if (call.last_signature) {
+        call.signature = signature_mix(call.signature, call.last_signature);
+        call.signature = signature_mix(call.signature, call.rows[call.last_child].repeat_count);
+    }
+}
+
+
+void SubtreeFolder::write(db::Database& database, const TraceRow& row) {
+    database.trace(row.trace_id, thread_id, row.fqn_id, row.parent_trace_id, row.depth,
+                   row.enter_seq, row.stack_id, row.transaction_id, row.exit_seq, row.repeat_count);
+}
+
+
+void SubtreeFolder::write(db::Database& database, OpenCall& call, size_t count) {
+    for (size_t i=0; i<count; i++) {
+        write(database, call.rows[i]);
+    }
+    call.rows.erase(call.rows.begin(), call.rows.begin() + count);
+    call.last_child -= count;
+}
+
+
+void SubtreeFolder::exit(db::Database& database, const unsigned long long exit_seq, const bool pinned) {
+    // Only the virtual root is left: the call was entered before the folder existed
+    if (open_calls.size() < 2)
+        return;
+
+    if (pinned)
+        pin(open_calls.size() - 1);
+
+    OpenCall& call = open_calls.back();
+    OpenCall& parent = open_calls[open_calls.size() - 2];
+
+    call.row.exit_seq = exit_seq;
+    close_run(call);
+
+    if (call.written) {
+        database.trace_exit(call.row.trace_id, exit_seq);
+        write(database, call, call.rows.size());
+        parent.last_signature = 0;
+    }
+    else if (!call.pinned && parent.last_signature == call.signature) {
+        parent.rows[parent.last_child].repeat_count++;
+    }
+    else {
+        // New run of callees: the previous one is complete
+        close_run(parent);
+        if (parent.written)
+            write(database, parent, parent.rows.size());
+
+        // Nothing folds into a pinned call either
+        parent.last_child = parent.rows.size();
+        parent.last_signature = call.pinned ? 0 : call.signature;
+        parent.rows.push_back(call.row);
+        parent.rows.insert(parent.rows.end(), call.rows.begin(), call.rows.end());
+    }
+
+    open_calls.pop_back();
+
+    // Once written, a call only keeps its last run of callees
+    if (!open_calls.back().written && open_calls.back().rows.size() > window)
+        spill(database);
+}
+
+
+// Write the open calls and their pending rows, except for the last run of
+// callees of each call, which can still be folded with the next sibling
+void SubtreeFolder::spill(db::Database& database) {
+    for (vector<OpenCall>::iterator iter=open_calls.begin(); iter!=open_calls.end(); ++iter) {
+        if (!iter->written) {
+            write(database, iter->row);
+            iter->written = true;
+        }
+        write(database, *iter, iter->last_signature ? iter->last_child : iter->rows.size());
+    }
+}
+
+
+void SubtreeFolder::flush(db::Database& database) {
+    for (vector<OpenCall>::iterator iter=open_calls.begin(); iter!=open_calls.end(); ++iter) {
+        if (!iter->written) {
+            write(database, iter->row);
+            iter->written = true;
+        }
+        write(database, *iter, iter->rows.size());
+        iter->last_signature = 0;
+    }
+}
+
+
+string thread_group(const string& thread_name) {
+    string::size_type end = thread_name.find_last_not_of("0123456789");
+    if (end == string::npos)
+        return thread_name;
+
+    // Drop the separator before the counter as well
+    if (end + 1 < thread_name.size()) {
+        end = thread_name.find_last_not_of("-_#. ", end);
+        if (end == string::npos)
+            return thread_name;
+    }
+    return thread_name.substr(0, end + 1);
+}
@@ -0,0 +1,420 @@
+/*
+  Java JVMTI Trace Extraction
+  by Romain Gaucher <r@rgaucher.info> - http://rgaucher.info
+
+  Copyright (c) 2011-2012 Romain Gaucher <r@rgaucher.info>
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef __AGGREGATE_H
+#define __AGGREGATE_H
+
+#include <map>
+#include <vector>
+#include <string>
+
+#include <boost/tuple/tuple.hpp>
+#include <boost/tuple/tuple_comparison.hpp>
+
+#include "config.h"
+#include "database.h"
+
+
+// Node of a calling context tree: one per distinct call path of a thread
+struct CallingContextNode {
+    unsigned long long id;
+    unsigned long long parent_id;
+    unsigned long long fqn_id;
+    unsigned int depth;
+
+    unsigned long long calls;
+    unsigned long long total_time;
+    unsigned long long self_time;
+    bool dirty;
+
+    std::map<unsigned long long, CallingContextNode*> children;
+
+    CallingContextNode(unsigned long long _id, unsigned long long _parent_id, unsigned long long _fqn_id, unsigned int _depth)
+     : id(_id), parent_id(_parent_id), fqn_id(_fqn_id), depth(_depth),
+       calls(0), total_time(0), self_time(0), dirty(false) {
+    }
+};
+
+
+// Calling context tree of a thread. The calls are folded in the tree as they
+// enter/exit, so its size depends on the number of distinct paths and not on
+// the number of calls
+class CallingContextTree {
+    // Currently open calls (the path from the root)
+    struct OpenCall {
+        CallingContextNode* node;
+        unsigned long long start;
+        unsigned long long children_time;
+    };
+
+    unsigned long long thread_id;
+    CallingContextNode root;
+    std::vector<OpenCall> open_calls;
+
+  private:
+    void flush(db::Database&, CallingContextNode*);
+    void release(CallingContextNode*);
+
+    CallingContextTree(const CallingContextTree& _p) : root(0, 0, 0, 0) {}
+    CallingContextTree& operator=(const CallingContextTree& _p) {
+        return *this;
+    }
+
+  public:
+    CallingContextTree(unsigned long long _thread_id)
+     : thread_id(_thread_id), root(0, 0, 0, 0) {
+    }
+
+    ~CallingContextTree();
+
+    // `next_node_id` is shared by all the trees so that node ids are unique
+    void enter(const unsigned long long fqn_id, const unsigned long long timestamp, unsigned long long& next_node_id);
+    void exit(const unsigned long long timestamp);
+
+    // Write the nodes updated since the last flush
+    void flush(db::Database&);
+};
+
+
+// (caller fqn, callee fqn, thread group)
+typedef boost::tuple<unsigned long long, unsigned long long, std::string> TupleEdge;
+
+struct CallEdge {
+    unsigned long long id;
+    unsigned long long calls;
+    unsigned long long total_time;
+    bool dirty;
+};
+
+
+// Dynamic call graph: how often each fqn calls another one, per group of
+// threads (see thread_group), regardless of the call ordering. The time of an
+// edge only counts its outermost activations on a thread, so that recursive
+// calls do not count the same time several times.
+class CallGraph {
+    struct OpenCall {
+        unsigned long long fqn_id;
+        CallEdge* edge;
+        unsigned long long start;
+    };
+
+    struct ThreadCalls {
+        std::vector<OpenCall> calls;
+        std::map<CallEdge*, unsigned int> active;      // open activations per edge
+    };
+
+    std::map<TupleEdge, CallEdge> edges;
+    std::map<unsigned int, ThreadCalls> open_calls;     // per thread_no
+    unsigned long long edge_counter;
+
+  public:
+    CallGraph()
+     : edge_counter(0) {
+    }
+
+    void enter(const unsigned int thread_no, const std::string& group, const unsigned long long fqn_id, const unsigned long long timestamp);
+    void exit(const unsigned int thread_no, const unsigned long long timestamp);
+
+    // Drop the open calls of an ended thread
+    void thread_end(const unsigned int thread_no);
+
+    // Write the edges updated since the last flush
+    void flush(db::Database&);
+
+    bool empty() const {
+        return edges.empty();
+    }
+};
+
+
+struct CallSummary {
+    unsigned long long calls;
+    unsigned long long first_seq;
+    unsigned long long last_seq;
+    bool dirty;
+};
+
+
+// Running number of calls, and enter_seq of the first/last call, per fqn,
+// thread or class, so that the reports do not scan `traces`
+class CallSummaries {
+    std::map<unsigned long long, CallSummary> summaries;
+
+  public:
+    void hit(const unsigned long long key_id, const unsigned long long sequence);
+
+    // Add the calls of another summary to the one of `key_id`
+    void merge(const unsigned long long key_id, const CallSummary& calls);
+    const CallSummary* find(const unsigned long long key_id) const;
+
+    // Write the summaries updated since the last flush to the table of `kind`
+    void flush(db::Database&, const db::SummaryKind kind);
+
+    bool empty() const {
+        return summaries.empty();
+    }
+};
+
+
+// Latencies (ns) counted in log-linear buckets: 16 buckets per power of two,
+// so that a bucket is within 1/16 of the values it counts, whatever their
+// magnitude. A percentile is the upper bound of its bucket. Only the range
+// of buckets between the smallest and the largest value is allocated.
+// Histograms merge by adding the counts of their buckets, including in the
+// DB (see `latency_histograms`).
+class LatencyHistogram {
+    std::vector<unsigned long long> counts;     // counts[i] is bucket first + i
+    std::size_t first;
+    unsigned long long total;
+    unsigned long long max_value;
+
+  private:
+    void cover(const std::size_t low, const std::size_t high);
+
+  public:
+    LatencyHistogram()
+     : first(0), total(0), max_value(0) {
+    }
+
+    void add(const unsigned long long value);
+    void merge(const LatencyHistogram&);
+
+    // Value under which `percent` % of the latencies are, 0 when empty
+    unsigned long long percentile(const double percent) const;
+
+    unsigned long long count() const {
+        return total;
+    }
+
+    std::size_t first_bucket() const {
+        return first;
+    }
+
+    const std::vector<unsigned long long>& bucket_counts() const {
+        return counts;
+    }
+
+    static std::size_t bucket(const unsigned long long value);
+    static unsigned long long bucket_low(const std::size_t bucket);
+    static unsigned long long bucket_high(const std::size_t bucket);
+};
+
+
+// (fqn, thread group)
+typedef boost::tuple<unsigned long long, std::string> TupleLatency;
+
+// Latency histogram of each fqn per group of threads, from the entry/exit
+// times of the calls the worker receives (all modes; with tail sampling, only
+// the kept transactions). The exits are matched by trace id, so the calls
+// whose entry or exit was not seen (flight recorder) are left out.
+class MethodLatencies {
+    struct OpenCall {
+        unsigned long long trace_id;
+        LatencyHistogram* histogram;
+        bool* dirty;
+        unsigned long long start;
+    };
+
+    struct Latencies {
+        LatencyHistogram histogram;
+        bool dirty;
+
+        Latencies()
+         : dirty(false) {
+        }
+    };
+
+    std::map<TupleLatency, Latencies> latencies;
+    std::map<unsigned int, std::vector<OpenCall> > open_calls;     // per thread_no
+
+  public:
+    void enter(const unsigned int thread_no, const std::string& group, const unsigned long long fqn_id,
+               const unsigned long long trace_id, const unsigned long long timestamp);
+    void exit(const unsigned int thread_no, const unsigned long long trace_id, const unsigned long long timestamp);
+
+    // Drop the open calls of an ended thread
+    void thread_end(const unsigned int thread_no);
+
+    // Write the histograms updated since the last flush
+    void flush(db::Database&);
+
+    bool empty() const {
+        return latencies.empty();
+    }
+};
+
+
+// (throw fqn, throw location, exception class)
+typedef boost::tuple<unsigned long long, long long, unsigned long long> TupleThrowSite;
+
+struct ExceptionSummary {
+    unsigned long long throws;
+    unsigned long long caught;
+    unsigned long long frames_unwound;
+    bool dirty;
+};
+
+
+// Number of exceptions thrown per throw site and exception class, how many
+// of them were caught by Java code and the frames they unwound
+class ExceptionSummaries {
+    std::map<TupleThrowSite, ExceptionSummary> summaries;
+
+  public:
+    void hit(const unsigned long long throw_fqn_id, const long long throw_location, const unsigned long long class_id,
+             const bool caught, const unsigned int frames_unwound);
+
+    // Write the summaries updated since the last flush
+    void flush(db::Database&);
+
+    bool empty() const {
+        return summaries.empty();
+    }
+};
+
+
+// (site fqn, site location, monitor class, wait)
+typedef boost::tuple<unsigned long long, long long, unsigned long long, bool> TupleLockSite;
+// (call path, monitor class, wait)
+typedef boost::tuple<unsigned long long, unsigned long long, bool> TupleLockStack;
+
+struct MonitorBlocking {
+    unsigned long long events;
+    unsigned long long blocked_time;
+    unsigned long long max_blocked_time;
+    bool dirty;
+};
+
+
+// Time the threads were blocked on monitors (contended enter or wait), per
+// site and per call path, and per monitor class
+class MonitorContention {
+    std::map<TupleLockSite, MonitorBlocking> sites;
+    std::map<TupleLockStack, MonitorBlocking> stacks;
+
+  public:
+    void hit(const unsigned long long site_fqn_id, const long long site_location, const unsigned long long stack_id,
+             const unsigned long long class_id, const bool wait, const unsigned long long blocked_time);
+
+    // Write the sites and paths updated since the last flush
+    void flush(db::Database&);
+
+    bool empty() const {
+        return sites.empty();
+    }
+};
+
+
+// (site fqn, site location, allocated class)
+typedef boost::tuple<unsigned long long, long long, unsigned long long> TupleAllocationSite;
+// (call path, allocated class)
+typedef boost::tuple<unsigned long long, unsigned long long> TupleAllocationStack;
+
+struct AllocationSamples {
+    unsigned long long samples;
+    unsigned long long bytes;
+    bool dirty;
+};
+
+
+// Allocation samples, and their bytes, per site and per call path, and per
+// allocated class
+class AllocationSummaries {
+    std::map<TupleAllocationSite, AllocationSamples> sites;
+    std::map<TupleAllocationStack, AllocationSamples> stacks;
+
+  public:
+    void hit(const unsigned long long site_fqn_id, const long long site_location, const unsigned long long stack_id,
+             const unsigned long long class_id, const unsigned long long size);
+
+    // Write the sites and paths updated since the last flush
+    void flush(db::Database&);
+
+    bool empty() const {
+        return sites.empty();
+    }
+};
+
+
+// Row of `traces` kept in memory by the SubtreeFolder
+struct TraceRow {
+    unsigned long long trace_id;
+    unsigned long long parent_trace_id;
+    unsigned long long enter_seq;
+    unsigned long long exit_seq;
+    unsigned long long stack_id;
+    unsigned long long repeat_count;
+    unsigned long long fqn_id;
+    unsigned int depth;
+    unsigned long long transaction_id;
+};
+
+
+// Fold the consecutive identical subtrees of a thread before they are written:
+// a call whose subtree is the same as the one of its previous sibling only
+// increments the `repeat_count` of that sibling. A completed subtree is kept
+// in memory until the next sibling shows whether it repeats, and a call whose
+// pending rows go over `window` is written right away (it, and its callers,
+// cannot be folded anymore). Calls of different transactions never fold.
+// The rows of the exceptions, monitor events and allocations refer to calls
+// of `traces`: such a call, and its callers, are pinned and never fold.
+class SubtreeFolder {
+    struct OpenCall {
+        TraceRow row;
+        std::vector<TraceRow> rows;           // completed subtrees of the callees
+        std::size_t last_child;               // first row of the last callee in `rows`
+        unsigned long long last_signature;    // 0 when the last callee cannot be folded
+        unsigned long long signature;
+        bool written;                         // `row` is already in the DB
+        bool pinned;                          // an event refers to the call or to a callee
+    };
+
+    unsigned long long thread_id;
+    std::size_t window;
+
+    // open_calls[0] is a virtual root, so that the top level calls get folded too
+    std::vector<OpenCall> open_calls;
+
+  private:
+    void close_run(OpenCall&);
+    void write(db::Database&, const TraceRow&);
+    void write(db::Database&, OpenCall&, std::size_t count);
+    void spill(db::Database&);
+    void pin(const std::size_t open_call);
+
+  public:
+    SubtreeFolder(unsigned long long _thread_id, std::size_t _window);
+
+    void enter(const TraceRow&);
+
+    // `pinned` when an event refers to the call (it was unwound by an exception)
+    void exit(db::Database&, const unsigned long long exit_seq, const bool pinned);
+
+    // An event refers to the call `trace_id`, if it is open
+    void pin(const unsigned long long trace_id);
+
+    // Write everything pending; what is written cannot be folded anymore
+    void flush(db::Database&);
+};
+
+
+// Name of the group of a thread: the thread name without its trailing counter
+// (e.g. "http-nio-8080-exec-12" -> "http-nio-8080-exec")
+std::string thread_group(const std::string& thread_name);
+
+#endif
@@ -0,0 +1,197 @@
+/*
+  Java JVMTI Trace Extraction
+  by Romain Gaucher <r@rgaucher.info> - http://rgaucher.info
+
+  Copyright (c) 2011-2012 Romain Gaucher <r@rgaucher.info>
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "config.h"
+
+
+// Memory held by a key or a value outside of the cache entry itself
+template <typename T>
+inline std::size_t heap_bytes(const T&) {
+    return 0;
+}
+
+inline std::size_t heap_bytes(const std::string& s) {
+    return s.capacity() + 1;
+}
+
+
+// Map bounded by a memory budget (in bytes), evicting with the CLOCK policy:
+// a lookup sets the reference bit of the entry, and the hand of the clock
+// evicts the first entry without it (clearing the bits it passes). Only the
+// cost of an entry is approximated: the slot, the index node and the heap
+// memory of the key and the value.
+// Not thread-safe, each cache is owned by the agent callbacks (under the
+// agent monitor) or by the worker.
+template <typename Key, typename Value>
+class ClockCache {
+    struct Slot {
+        Key key;
+        Value value;
+        std::size_t bytes;
+        bool referenced;
+        bool used;
+    };
+
+    typedef std::map<Key, std::size_t> SlotIndex;
+
+    SlotIndex index;
+    std::vector<Slot> slots;
+    std::vector<std::size_t> free_slots;
+    std::size_t hand;
+
+    std::size_t budget;
+    std::size_t used_bytes;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+
+  private:
+    // Red-black tree node: the (key, slot) pair and 4 words of links
+    static std::size_t entry_bytes(const Key& key, const Value& value) {
+        return sizeof(Slot) + sizeof(typename SlotIndex::value_type) + 4 * sizeof(void*)
+             + heap_bytes(key) + heap_bytes(value);
+    }
+
+    void release(const std::size_t slot) {
+        Slot& victim = slots[slot];
+        index.erase(victim.key);
+        used_bytes -= victim.bytes;
+        victim.used = false;
+        victim.key = Key();
+        victim.value = Value();
+        free_slots.push_back(slot);
+    }
+
+    void evict(const std::size_t needed) {
+        while (!index.empty() && used_bytes + needed > budget) {
+            hand = (hand + 1) % slots.size();
+            Slot& slot = slots[hand];
+            if (!slot.used)
+                continue;
+
+            if (slot.referenced)
+                slot.referenced = false;
+            else {
+                release(hand);
+                evictions++;
+            }
+        }
+    }
+
+  public:
+    explicit ClockCache(const std::size_t _budget = CACHE_BUDGET_MB * 1024 * 1024)
+     : hand(0), budget(_budget), used_bytes(0), hits(0), misses(0), evictions(0) {
+    }
+
+    void set_budget(const std::size_t _budget) {
+        budget = _budget;
+        evict(0);
+    }
+
+    // Value of `key`, 0 when it is not cached. The pointer is valid until the
+    // next insert
+    Value* find(const Key& key) {
+        typename SlotIndex::const_iterator iter = index.find(key);
+        if (iter == index.end()) {
+            misses++;
+            return 0;
+        }
+
+        hits++;
+        Slot& slot = slots[iter->second];
+        slot.referenced = true;
+        return &slot.value;
+    }
+
+    // Add (or replace) the value of `key`, evicting what is needed to stay in
+    // the budget. An entry larger than the budget is still kept, alone.
+    Value& insert(const Key& key, const Value& value) {
+        erase(key);
+
+        std::size_t bytes = entry_bytes(key, value);
+        evict(bytes);
+
+        std::size_t position = 0;
+        if (free_slots.empty()) {
+            position = slots.size();
+            slots.push_back(Slot());
+        }
+        else {
+            position = free_slots.back();
+            free_slots.pop_back();
+        }
+
+        Slot& slot = slots[position];
+        slot.key = key;
+        slot.value = value;
+        slot.bytes = bytes;
+        slot.referenced = false;
+        slot.used = true;
+
+        index[key] = position;
+        used_bytes += bytes;
+        return slot.value;
+    }
+
+    bool erase(const Key& key) {
+        typename SlotIndex::const_iterator iter = index.find(key);
+        if (iter == index.end())
+            return false;
+        release(iter->second);
+        return true;
+    }
+
+    // Drop the entries for which `predicate(key, value)` holds
+    template <typename Predicate>
+    std::size_t erase_if(const Predicate& predicate) {
+        std::size_t erased = 0;
+        for (std::size_t i=0; i<slots.size(); i++) {
+            if (slots[i].used && predicate(slots[i].key, slots[i].value)) {
+                release(i);
+                erased++;
+            }
+        }
+        return erased;
+    }
+
+    std::size_t size() const {
+        return index.size();
+    }
+
+    // Memory accounting, as `<name>.entries`, `<name>.bytes`, ... metrics
+    void report(const std::string& name, std::map<std::string, unsigned long long>& metrics) const {
+        metrics[name + ".entries"] = index.size();
+        metrics[name + ".bytes"] = used_bytes;
+        metrics[name + ".budget"] = budget;
+        metrics[name + ".hits"] = hits;
+        metrics[name + ".misses"] = misses;
+        metrics[name + ".evictions"] = evictions;
+    }
+};
+
+// Self-metrics of the agent, by name
+typedef std::map<std::string, unsigned long long> AgentMetrics;
+
+#endif
@@ -22,6 +22,59 @@
 #define USE_DATABASE
 #define DATABASE_PERIODIC_DUMP
 
+// Checkpoints copy the in-memory DB to the file by steps of CHECKPOINT_STEP_PAGES
+// pages, and sleep CHECKPOINT_PAUSE_MS between the steps
+#define CHECKPOINT_STEP_PAGES 64
+#define CHECKPOINT_PAUSE_MS 2
+
+// Default number of events kept by the crash journal (`journal_records` option)
+#define JOURNAL_RECORDS 262144
+
+// Memory budget of the agent caches, in MB (`cache_budget` option)
+#define CACHE_BUDGET_MB 64
+
+// The callbacks send their self-metrics every METRICS_PERIOD_MASK+1 events
+#define METRICS_PERIOD_MASK 0xfffff
+
+// Flight recorder: FLIGHT_SIGNAL asks for a dump of the rings, the flight
+// thread checks the signal and the control file every FLIGHT_POLL_MS, and the
+// triggers are ignored for FLIGHT_MIN_INTERVAL_MS after a dump
+#define FLIGHT_SIGNAL SIGUSR1
+#define FLIGHT_POLL_MS 200
+#define FLIGHT_MIN_INTERVAL_MS 1000
+
+// Rings of the ended threads kept for the next flight dump (the oldest go)
+#define FLIGHT_ENDED_THREADS 64
+
+// Tail sampling buffers at most TAIL_MAX_EVENTS events per transaction, the
+// larger transactions are kept
+#define TAIL_MAX_EVENTS 65536
+
+// Sample the allocations with SampledObjectAlloc (JVMTI 11: only when building
+// against the jvmti.h of a JDK 11+, the one of the Makefile has no such event).
+// Without it, or when the JVM cannot, the agent samples the allocations the
+// VM reports by itself (VMObjectAlloc: JNI, reflection, ...)
+//#define USE_SAMPLED_ALLOCATION
+
+// Default sampling interval of the allocations, in bytes (`allocations` option)
+#define ALLOCATION_INTERVAL 524288
+
+// The heap census runs at most once every HEAP_CENSUS_MIN_INTERVAL_MS,
+// whatever asks for it (period of `heap_census`, DataDumpRequest)
+#define HEAP_CENSUS_MIN_INTERVAL_MS 10000
+
+// Leak suspects of a census (`retention_paths` option): at most
+// LEAK_SUSPECT_CLASSES classes, those which grew the most (at least
+// LEAK_SUSPECT_MIN_GROWTH bytes) since the previous census. The walk from the
+// GC roots stops once it has its samples (RETENTION_PATH_SAMPLES per class by
+// default) or has reached RETENTION_MAX_OBJECTS objects, which bounds its
+// pause and its memory. A path keeps at most RETENTION_PATH_DEPTH links.
+#define LEAK_SUSPECT_CLASSES 3
+#define LEAK_SUSPECT_MIN_GROWTH 1048576
+#define RETENTION_PATH_SAMPLES 32
+#define RETENTION_MAX_OBJECTS 2000000
+#define RETENTION_PATH_DEPTH 16
+
 //#define DEBUG_INLINE
 
 #endif
@@ -25,7 +25,7 @@ using namespace std;
 
 
 Database::Database()
-: usable(false), sqlite_db(0) {
+: usable(false), sqlite_db(0), checkpoint_running(false), checkpoint_pending(false), checkpoint_finalize(false) {
     // Instanciate the in-memory SQLite
     if (SQLITE_OK == sqlite3_open(":memory:", &sqlite_db)) {
         backup_path = "java-trace.db";
@@ -35,7 +35,18 @@ Database::Database()
 }
 
 
-unsigned int Database::thread(const string& thread_name) {
+void Database::begin() {
+    if (ready())
+        sqlite3_exec(sqlite_db, "BEGIN;", 0, 0, 0);
+}
+
+void Database::commit() {
+    if (ready())
+        sqlite3_exec(sqlite_db, "COMMIT;", 0, 0, 0);
+}
+
+
+unsigned long long Database::thread(const string& thread_name) {
     if (!ready())
         return 0;
     if (SQLITE_OK != sqlite3_bind_text(insert_thread, 1,  thread_name.c_str(), thread_name.size(), SQLITE_STATIC)) {
@@ -45,10 +56,10 @@ unsigned int Database::thread(const string& thread_name) {
         return 0;
     }
     sqlite3_reset(insert_thread);  
-    return static_cast<unsigned int>(sqlite3_last_insert_rowid(sqlite_db));
+    return static_cast<unsigned long long>(sqlite3_last_insert_rowid(sqlite_db));
 }
 
-unsigned int Database::method(const string& method_name) {
+unsigned long long Database::method(const string& method_name) {
     if (!ready())
         return 0;
     if (SQLITE_OK != sqlite3_bind_text(insert_method, 1,  method_name.c_str(), method_name.size(), SQLITE_STATIC)) {
@@ -58,10 +69,10 @@ unsigned int Database::method(const string& method_name) {
         return 0;
     }
     sqlite3_reset(insert_method);  
-    return static_cast<unsigned int>(sqlite3_last_insert_rowid(sqlite_db));
+    return static_cast<unsigned long long>(sqlite3_last_insert_rowid(sqlite_db));
 }
 
-unsigned int Database::clazz(const std::string& class_name) {
+unsigned long long Database::clazz(const std::string& class_name) {
     if (!ready())
         return 0;
     if (SQLITE_OK != sqlite3_bind_text(insert_class, 1,  class_name.c_str(), class_name.size(), SQLITE_STATIC)) {
@@ -71,10 +82,10 @@ unsigned int Database::clazz(const std::string& class_name) {
         return 0;
     }
     sqlite3_reset(insert_class);  
-    return static_cast<unsigned int>(sqlite3_last_insert_rowid(sqlite_db));
+    return static_cast<unsigned long long>(sqlite3_last_insert_rowid(sqlite_db));
 }
 
-unsigned int Database::signature(const std::string& signature_name) {
+unsigned long long Database::signature(const std::string& signature_name) {
     if (!ready())
         return 0;
     if (SQLITE_OK != sqlite3_bind_text(insert_signature, 1,  signature_name.c_str(), signature_name.size(), SQLITE_STATIC)) {
@@ -84,58 +95,724 @@ unsigned int Database::signature(const std::string& signature_name) {
         return 0;
     }
     sqlite3_reset(insert_signature);  
-    return static_cast<unsigned int>(sqlite3_last_insert_rowid(sqlite_db));
+    return static_cast<unsigned long long>(sqlite3_last_insert_rowid(sqlite_db));
 }
 
-unsigned int Database::fqn(const unsigned int class_id, const unsigned int method_id, const unsigned int signature_id, const unsigned int jmethod_id) {
+unsigned long long Database::fqn(const unsigned long long class_id, const unsigned long long method_id, const unsigned long long signature_id, const unsigned long long jmethod_id) {
     if (!ready())
         return 0;
-    if (SQLITE_OK != sqlite3_bind_int(insert_fqn, 1,  class_id)) {
+    if (SQLITE_OK != sqlite3_bind_int64(insert_fqn, 1,  class_id)) {
         return 0;
     }
-    if (SQLITE_OK != sqlite3_bind_int(insert_fqn, 2,  method_id)) {
+    if (SQLITE_OK != sqlite3_bind_int64(insert_fqn, 2,  method_id)) {
         return 0;
     }
-    if (SQLITE_OK != sqlite3_bind_int(insert_fqn, 3,  signature_id)) {
+    if (SQLITE_OK != sqlite3_bind_int64(insert_fqn, 3,  signature_id)) {
         return 0;
     }
-    if (SQLITE_OK != sqlite3_bind_int(insert_fqn, 4,  jmethod_id)) {
+    if (SQLITE_OK != sqlite3_bind_int64(insert_fqn, 4,  jmethod_id)) {
         return 0;
     }
     if (SQLITE_DONE != sqlite3_step(insert_fqn)) {
         return 0;
     }
     sqlite3_reset(insert_fqn);  
-    return static_cast<unsigned int>(sqlite3_last_insert_rowid(sqlite_db));
+    return static_cast<unsigned long long>(sqlite3_last_insert_rowid(sqlite_db));
 }
 
-unsigned int Database::trace(const unsigned int thread_id, const unsigned int fqn_id, const unsigned long long  parent_trace_id) {
+bool Database::fqn_names(const unsigned long long fqn_id, const unsigned long long class_id, const unsigned long long method_id, const unsigned long long signature_id) {
+    if (!ready())
+        return false;
+    if (SQLITE_OK != sqlite3_bind_int64(update_fqn_names, 1,  class_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(update_fqn_names, 2,  method_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(update_fqn_names, 3,  signature_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(update_fqn_names, 4,  fqn_id)) {
+        return false;
+    }
+    if (SQLITE_DONE != sqlite3_step(update_fqn_names)) {
+        sqlite3_reset(update_fqn_names);
+        return false;
+    }
+    sqlite3_reset(update_fqn_names);
+    return true;
+}
+
+unsigned long long Database::trace(const unsigned long long trace_id, const unsigned long long thread_id, const unsigned long long fqn_id, const unsigned long long parent_trace_id, const unsigned int depth, const unsigned long long enter_seq, const unsigned long long stack_id, const unsigned long long transaction_id, const unsigned long long exit_seq, const unsigned long long repeat_count) {
     if (!ready())
         return 0;
-    if (SQLITE_OK != sqlite3_bind_int(insert_trace, 1,  thread_id)) {
+    if (SQLITE_OK != sqlite3_bind_int64(insert_trace, 1,  trace_id)) {
+        return 0;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_trace, 2,  thread_id)) {
+        return 0;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_trace, 3,  fqn_id)) {
+        return 0;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_trace, 4,  parent_trace_id)) {
         return 0;
     }
-    if (SQLITE_OK != sqlite3_bind_int(insert_trace, 2,  fqn_id)) {
+    if (SQLITE_OK != sqlite3_bind_int(insert_trace, 5,  depth)) {
         return 0;
     }
-    if (SQLITE_OK != sqlite3_bind_int(insert_trace, 3,  parent_trace_id)) {
+    if (SQLITE_OK != sqlite3_bind_int64(insert_trace, 6,  enter_seq)) {
+        return 0;
+    }
+    // Not known yet, set by trace_exit
+    if (exit_seq) {
+        if (SQLITE_OK != sqlite3_bind_int64(insert_trace, 7,  exit_seq)) {
+            return 0;
+        }
+    }
+    else if (SQLITE_OK != sqlite3_bind_null(insert_trace, 7)) {
+        return 0;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_trace, 8,  stack_id)) {
+        return 0;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_trace, 9,  repeat_count)) {
+        return 0;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_trace, 10,  transaction_id)) {
         return 0;
     }
     if (SQLITE_DONE != sqlite3_step(insert_trace)) {
+        sqlite3_reset(insert_trace);
         return 0;
     }
     sqlite3_reset(insert_trace);  
-    return static_cast<unsigned int>(sqlite3_last_insert_rowid(sqlite_db));
+    return trace_id;
+}
+
+bool Database::trace_exit(const unsigned long long trace_id, const unsigned long long exit_seq) {
+    if (!ready())
+        return false;
+    if (SQLITE_OK != sqlite3_bind_int64(update_trace_exit, 1,  exit_seq)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(update_trace_exit, 2,  trace_id)) {
+        return false;
+    }
+    if (SQLITE_DONE != sqlite3_step(update_trace_exit)) {
+        sqlite3_reset(update_trace_exit);
+        return false;
+    }
+    sqlite3_reset(update_trace_exit);
+    return true;
+}
+
+bool Database::stack(const unsigned long long stack_id, const unsigned long long parent_stack_id, const unsigned long long fqn_id, const unsigned int depth) {
+    if (!ready())
+        return false;
+    if (SQLITE_OK != sqlite3_bind_int64(insert_stack, 1,  stack_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_stack, 2,  parent_stack_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_stack, 3,  fqn_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int(insert_stack, 4,  depth)) {
+        return false;
+    }
+    if (SQLITE_DONE != sqlite3_step(insert_stack)) {
+        sqlite3_reset(insert_stack);
+        return false;
+    }
+    sqlite3_reset(insert_stack);
+    return true;
+}
+
+
+bool Database::cct_node(const unsigned long long node_id, const unsigned long long thread_id, const unsigned long long parent_id, const unsigned long long fqn_id, const unsigned int depth, const unsigned long long calls, const unsigned long long total_time, const unsigned long long self_time) {
+    if (!ready())
+        return false;
+    if (SQLITE_OK != sqlite3_bind_int64(replace_cct_node, 1,  node_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_cct_node, 2,  thread_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_cct_node, 3,  parent_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_cct_node, 4,  fqn_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int(replace_cct_node, 5,  depth)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_cct_node, 6,  calls)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_cct_node, 7,  total_time)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_cct_node, 8,  self_time)) {
+        return false;
+    }
+    if (SQLITE_DONE != sqlite3_step(replace_cct_node)) {
+        sqlite3_reset(replace_cct_node);
+        return false;
+    }
+    sqlite3_reset(replace_cct_node);
+    return true;
+}
+
+bool Database::edge(const unsigned long long edge_id, const unsigned long long caller_fqn_id, const unsigned long long callee_fqn_id, const string& thread_group, const unsigned long long calls, const unsigned long long total_time) {
+    if (!ready())
+        return false;
+    if (SQLITE_OK != sqlite3_bind_int64(replace_edge, 1,  edge_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_edge, 2,  caller_fqn_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_edge, 3,  callee_fqn_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_text(replace_edge, 4,  thread_group.c_str(), thread_group.size(), SQLITE_STATIC)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_edge, 5,  calls)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_edge, 6,  total_time)) {
+        return false;
+    }
+    if (SQLITE_DONE != sqlite3_step(replace_edge)) {
+        sqlite3_reset(replace_edge);
+        return false;
+    }
+    sqlite3_reset(replace_edge);
+    return true;
+}
+
+
+bool Database::summary(const SummaryKind kind, const unsigned long long key_id, const unsigned long long calls, const unsigned long long first_seq, const unsigned long long last_seq) {
+    if (!ready())
+        return false;
+    sqlite3_stmt* replace_stmt = replace_summary[kind];
+    if (SQLITE_OK != sqlite3_bind_int64(replace_stmt, 1,  key_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_stmt, 2,  calls)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_stmt, 3,  first_seq)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_stmt, 4,  last_seq)) {
+        return false;
+    }
+    if (SQLITE_DONE != sqlite3_step(replace_stmt)) {
+        sqlite3_reset(replace_stmt);
+        return false;
+    }
+    sqlite3_reset(replace_stmt);
+    return true;
+}
+
+
+bool Database::metric(const string& name, const unsigned long long value) {
+    if (!ready())
+        return false;
+    if (SQLITE_OK != sqlite3_bind_text(replace_metric, 1,  name.c_str(), name.size(), SQLITE_STATIC)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_metric, 2,  value)) {
+        return false;
+    }
+    if (SQLITE_DONE != sqlite3_step(replace_metric)) {
+        sqlite3_reset(replace_metric);
+        return false;
+    }
+    sqlite3_reset(replace_metric);
+    return true;
+}
+
+
+bool Database::latency_bucket(const unsigned long long fqn_id, const string& thread_group, const unsigned long long bucket, const unsigned long long low, const unsigned long long high, const unsigned long long calls) {
+    if (!ready())
+        return false;
+    if (SQLITE_OK != sqlite3_bind_int64(replace_latency_bucket, 1,  fqn_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_text(replace_latency_bucket, 2,  thread_group.c_str(), thread_group.size(), SQLITE_STATIC)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_latency_bucket, 3,  bucket)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_latency_bucket, 4,  low)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_latency_bucket, 5,  high)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_latency_bucket, 6,  calls)) {
+        return false;
+    }
+    if (SQLITE_DONE != sqlite3_step(replace_latency_bucket)) {
+        sqlite3_reset(replace_latency_bucket);
+        return false;
+    }
+    sqlite3_reset(replace_latency_bucket);
+    return true;
+}
+
+
+bool Database::exception(const unsigned long long thread_id, const unsigned long long class_id, const unsigned long long throw_fqn_id, const long long throw_location, const unsigned long long throw_trace_id, const unsigned long long catch_fqn_id, const long long catch_location, const unsigned long long catch_trace_id, const unsigned int frames_unwound, const unsigned long long sequence, const unsigned long long transaction_id) {
+    if (!ready())
+        return false;
+    if (SQLITE_OK != sqlite3_bind_int64(insert_exception, 1,  thread_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_exception, 2,  class_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_exception, 3,  throw_fqn_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_exception, 4,  throw_location)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_exception, 5,  throw_trace_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_exception, 6,  catch_fqn_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_exception, 7,  catch_location)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_exception, 8,  catch_trace_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_exception, 9,  frames_unwound)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_exception, 10,  sequence)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_exception, 11,  transaction_id)) {
+        return false;
+    }
+    if (SQLITE_DONE != sqlite3_step(insert_exception)) {
+        sqlite3_reset(insert_exception);
+        return false;
+    }
+    sqlite3_reset(insert_exception);
+    return true;
+}
+
+
+bool Database::exception_summary(const unsigned long long throw_fqn_id, const long long throw_location, const unsigned long long class_id, const unsigned long long throws, const unsigned long long caught, const unsigned long long frames_unwound) {
+    if (!ready())
+        return false;
+    if (SQLITE_OK != sqlite3_bind_int64(replace_exception_summary, 1,  throw_fqn_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_exception_summary, 2,  throw_location)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_exception_summary, 3,  class_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_exception_summary, 4,  throws)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_exception_summary, 5,  caught)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_exception_summary, 6,  frames_unwound)) {
+        return false;
+    }
+    if (SQLITE_DONE != sqlite3_step(replace_exception_summary)) {
+        sqlite3_reset(replace_exception_summary);
+        return false;
+    }
+    sqlite3_reset(replace_exception_summary);
+    return true;
+}
+
+
+bool Database::monitor_event(const unsigned long long thread_id, const bool wait, const unsigned long long class_id, const unsigned long long site_fqn_id, const long long site_location, const unsigned long long trace_id, const unsigned long long start_time, const unsigned long long blocked_time, const unsigned long long transaction_id) {
+    if (!ready())
+        return false;
+    if (SQLITE_OK != sqlite3_bind_int64(insert_monitor_event, 1,  thread_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_monitor_event, 2,  wait ? 1 : 0)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_monitor_event, 3,  class_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_monitor_event, 4,  site_fqn_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_monitor_event, 5,  site_location)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_monitor_event, 6,  trace_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_monitor_event, 7,  start_time)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_monitor_event, 8,  blocked_time)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_monitor_event, 9,  transaction_id)) {
+        return false;
+    }
+    if (SQLITE_DONE != sqlite3_step(insert_monitor_event)) {
+        sqlite3_reset(insert_monitor_event);
+        return false;
+    }
+    sqlite3_reset(insert_monitor_event);
+    return true;
+}
+
+
+bool Database::monitor_site(const unsigned long long site_fqn_id, const long long site_location, const unsigned long long class_id, const bool wait, const unsigned long long events, const unsigned long long blocked_time, const unsigned long long max_blocked_time) {
+    if (!ready())
+        return false;
+    if (SQLITE_OK != sqlite3_bind_int64(replace_monitor_site, 1,  site_fqn_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_monitor_site, 2,  site_location)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_monitor_site, 3,  class_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_monitor_site, 4,  wait ? 1 : 0)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_monitor_site, 5,  events)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_monitor_site, 6,  blocked_time)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_monitor_site, 7,  max_blocked_time)) {
+        return false;
+    }
+    if (SQLITE_DONE != sqlite3_step(replace_monitor_site)) {
+        sqlite3_reset(replace_monitor_site);
+        return false;
+    }
+    sqlite3_reset(replace_monitor_site);
+    return true;
+}
+
+
+bool Database::monitor_stack(const unsigned long long stack_id, const unsigned long long class_id, const bool wait, const unsigned long long events, const unsigned long long blocked_time, const unsigned long long max_blocked_time) {
+    if (!ready())
+        return false;
+    if (SQLITE_OK != sqlite3_bind_int64(replace_monitor_stack, 1,  stack_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_monitor_stack, 2,  class_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_monitor_stack, 3,  wait ? 1 : 0)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_monitor_stack, 4,  events)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_monitor_stack, 5,  blocked_time)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_monitor_stack, 6,  max_blocked_time)) {
+        return false;
+    }
+    if (SQLITE_DONE != sqlite3_step(replace_monitor_stack)) {
+        sqlite3_reset(replace_monitor_stack);
+        return false;
+    }
+    sqlite3_reset(replace_monitor_stack);
+    return true;
+}
+
+
+bool Database::allocation(const unsigned long long thread_id, const unsigned long long class_id, const unsigned long long size, const unsigned long long site_fqn_id, const long long site_location, const unsigned long long stack_id, const unsigned long long trace_id, const unsigned long long time, const unsigned long long transaction_id) {
+    if (!ready())
+        return false;
+    if (SQLITE_OK != sqlite3_bind_int64(insert_allocation, 1,  thread_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_allocation, 2,  class_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_allocation, 3,  size)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_allocation, 4,  site_fqn_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_allocation, 5,  site_location)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_allocation, 6,  stack_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_allocation, 7,  trace_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_allocation, 8,  time)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_allocation, 9,  transaction_id)) {
+        return false;
+    }
+    if (SQLITE_DONE != sqlite3_step(insert_allocation)) {
+        sqlite3_reset(insert_allocation);
+        return false;
+    }
+    sqlite3_reset(insert_allocation);
+    return true;
+}
+
+
+bool Database::allocation_site(const unsigned long long site_fqn_id, const long long site_location, const unsigned long long class_id, const unsigned long long samples, const unsigned long long bytes) {
+    if (!ready())
+        return false;
+    if (SQLITE_OK != sqlite3_bind_int64(replace_allocation_site, 1,  site_fqn_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_allocation_site, 2,  site_location)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_allocation_site, 3,  class_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_allocation_site, 4,  samples)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_allocation_site, 5,  bytes)) {
+        return false;
+    }
+    if (SQLITE_DONE != sqlite3_step(replace_allocation_site)) {
+        sqlite3_reset(replace_allocation_site);
+        return false;
+    }
+    sqlite3_reset(replace_allocation_site);
+    return true;
+}
+
+
+bool Database::allocation_stack(const unsigned long long stack_id, const unsigned long long class_id, const unsigned long long samples, const unsigned long long bytes) {
+    if (!ready())
+        return false;
+    if (SQLITE_OK != sqlite3_bind_int64(replace_allocation_stack, 1,  stack_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_allocation_stack, 2,  class_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_allocation_stack, 3,  samples)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(replace_allocation_stack, 4,  bytes)) {
+        return false;
+    }
+    if (SQLITE_DONE != sqlite3_step(replace_allocation_stack)) {
+        sqlite3_reset(replace_allocation_stack);
+        return false;
+    }
+    sqlite3_reset(replace_allocation_stack);
+    return true;
+}
+
+
+unsigned long long Database::heap_snapshot(const unsigned long long time, const string& reason, const unsigned long long duration, const unsigned long long classes, const unsigned long long instances, const unsigned long long bytes) {
+    if (!ready())
+        return 0;
+    if (SQLITE_OK != sqlite3_bind_int64(insert_heap_snapshot, 1,  time)) {
+        return 0;
+    }
+    if (SQLITE_OK != sqlite3_bind_text(insert_heap_snapshot, 2,  reason.c_str(), reason.size(), SQLITE_STATIC)) {
+        return 0;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_heap_snapshot, 3,  duration)) {
+        return 0;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_heap_snapshot, 4,  classes)) {
+        return 0;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_heap_snapshot, 5,  instances)) {
+        return 0;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_heap_snapshot, 6,  bytes)) {
+        return 0;
+    }
+    if (SQLITE_DONE != sqlite3_step(insert_heap_snapshot)) {
+        sqlite3_reset(insert_heap_snapshot);
+        return 0;
+    }
+    sqlite3_reset(insert_heap_snapshot);
+    return static_cast<unsigned long long>(sqlite3_last_insert_rowid(sqlite_db));
+}
+
+
+bool Database::heap_class(const unsigned long long snapshot_id, const unsigned long long class_id, const unsigned long long instances, const unsigned long long bytes) {
+    if (!ready())
+        return false;
+    if (SQLITE_OK != sqlite3_bind_int64(insert_heap_class, 1,  snapshot_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_heap_class, 2,  class_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_heap_class, 3,  instances)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_heap_class, 4,  bytes)) {
+        return false;
+    }
+    if (SQLITE_DONE != sqlite3_step(insert_heap_class)) {
+        sqlite3_reset(insert_heap_class);
+        return false;
+    }
+    sqlite3_reset(insert_heap_class);
+    return true;
+}
+
+
+unsigned long long Database::retention_path(const unsigned long long snapshot_id, const unsigned long long class_id, const string& root, const unsigned long long samples) {
+    if (!ready())
+        return 0;
+    if (SQLITE_OK != sqlite3_bind_int64(insert_retention_path, 1,  snapshot_id)) {
+        return 0;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_retention_path, 2,  class_id)) {
+        return 0;
+    }
+    if (SQLITE_OK != sqlite3_bind_text(insert_retention_path, 3,  root.c_str(), root.size(), SQLITE_STATIC)) {
+        return 0;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_retention_path, 4,  samples)) {
+        return 0;
+    }
+    if (SQLITE_DONE != sqlite3_step(insert_retention_path)) {
+        sqlite3_reset(insert_retention_path);
+        return 0;
+    }
+    sqlite3_reset(insert_retention_path);
+    return static_cast<unsigned long long>(sqlite3_last_insert_rowid(sqlite_db));
+}
+
+
+bool Database::retention_link(const unsigned long long path_id, const unsigned int depth, const unsigned long long class_id, const unsigned long long repeat_count) {
+    if (!ready())
+        return false;
+    if (SQLITE_OK != sqlite3_bind_int64(insert_retention_link, 1,  path_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int(insert_retention_link, 2,  depth)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_retention_link, 3,  class_id)) {
+        return false;
+    }
+    if (SQLITE_OK != sqlite3_bind_int64(insert_retention_link, 4,  repeat_count)) {
+        return false;
+    }
+    if (SQLITE_DONE != sqlite3_step(insert_retention_link)) {
+        sqlite3_reset(insert_retention_link);
+        return false;
+    }
+    sqlite3_reset(insert_retention_link);
+    return true;
+}
+
+
+// Run a single-row SELECT of an id, whose parameters are bound
+static unsigned long long select_id(sqlite3_stmt* select_stmt) {
+    unsigned long long id = 0;
+    if (SQLITE_ROW == sqlite3_step(select_stmt))
+        id = static_cast<unsigned long long>(sqlite3_column_int64(select_stmt, 0));
+    sqlite3_reset(select_stmt);
+    return id;
+}
+
+unsigned long long Database::find_name(const NameKind kind, const string& name) {
+    if (!ready())
+        return 0;
+    sqlite3_stmt* select_stmt = select_name[kind];
+    if (SQLITE_OK != sqlite3_bind_text(select_stmt, 1,  name.c_str(), name.size(), SQLITE_STATIC)) {
+        return 0;
+    }
+    return select_id(select_stmt);
+}
+
+unsigned long long Database::find_fqn(const unsigned long long jmethod_id) {
+    if (!ready())
+        return 0;
+    if (SQLITE_OK != sqlite3_bind_int64(select_fqn, 1,  jmethod_id)) {
+        return 0;
+    }
+    return select_id(select_fqn);
+}
+
+unsigned long long Database::fqn_class(const unsigned long long fqn_id) {
+    if (!ready())
+        return 0;
+    if (SQLITE_OK != sqlite3_bind_int64(select_fqn_class, 1,  fqn_id)) {
+        return 0;
+    }
+    return select_id(select_fqn_class);
 }
 
 
 Database::~Database() {
+    wait_checkpoint();
+
     sqlite3_finalize(insert_trace);
+    sqlite3_finalize(update_trace_exit);
+    sqlite3_finalize(insert_stack);
     sqlite3_finalize(insert_thread);
     sqlite3_finalize(insert_fqn);
+    sqlite3_finalize(update_fqn_names);
     sqlite3_finalize(insert_class);
     sqlite3_finalize(insert_method);
     sqlite3_finalize(insert_signature);
+    sqlite3_finalize(replace_cct_node);
+    sqlite3_finalize(replace_edge);
+    sqlite3_finalize(replace_summary[SUMMARY_FQN]);
+    sqlite3_finalize(replace_summary[SUMMARY_THREAD]);
+    sqlite3_finalize(replace_summary[SUMMARY_CLASS]);
+    sqlite3_finalize(replace_metric);
+    sqlite3_finalize(replace_latency_bucket);
+    sqlite3_finalize(insert_exception);
+    sqlite3_finalize(replace_exception_summary);
+    sqlite3_finalize(insert_monitor_event);
+    sqlite3_finalize(replace_monitor_site);
+    sqlite3_finalize(replace_monitor_stack);
+    sqlite3_finalize(insert_allocation);
+    sqlite3_finalize(replace_allocation_site);
+    sqlite3_finalize(replace_allocation_stack);
+    sqlite3_finalize(insert_heap_snapshot);
+    sqlite3_finalize(insert_heap_class);
+    sqlite3_finalize(insert_retention_path);
+    sqlite3_finalize(insert_retention_link);
+    sqlite3_finalize(select_name[NAME_THREAD]);
+    sqlite3_finalize(select_name[NAME_CLASS]);
+    sqlite3_finalize(select_name[NAME_METHOD]);
+    sqlite3_finalize(select_name[NAME_SIGNATURE]);
+    sqlite3_finalize(select_fqn);
+    sqlite3_finalize(select_fqn_class);
 
     // Close the DB when everything is cleared
     sqlite3_close(sqlite_db);
@@ -159,16 +836,44 @@ void Database::create_schema() {
         
         // Instanciate the prepared statements
         sqlite3_prepare(sqlite_db, stmt_insert_trace, -1, &insert_trace, 0);
+        sqlite3_prepare(sqlite_db, stmt_update_trace_exit, -1, &update_trace_exit, 0);
+        sqlite3_prepare(sqlite_db, stmt_insert_stack, -1, &insert_stack, 0);
         sqlite3_prepare(sqlite_db, stmt_insert_thread, -1, &insert_thread, 0);
         sqlite3_prepare(sqlite_db, stmt_insert_fqn, -1, &insert_fqn, 0);
+        sqlite3_prepare(sqlite_db, stmt_update_fqn_names, -1, &update_fqn_names, 0);
         sqlite3_prepare(sqlite_db, stmt_insert_class, -1, &insert_class, 0);
         sqlite3_prepare(sqlite_db, stmt_insert_method, -1, &insert_method, 0);
         sqlite3_prepare(sqlite_db, stmt_insert_signature, -1, &insert_signature, 0);
+        sqlite3_prepare(sqlite_db, stmt_replace_cct_node, -1, &replace_cct_node, 0);
+        sqlite3_prepare(sqlite_db, stmt_replace_edge, -1, &replace_edge, 0);
+        sqlite3_prepare(sqlite_db, stmt_replace_fqn_summary, -1, &replace_summary[SUMMARY_FQN], 0);
+        sqlite3_prepare(sqlite_db, stmt_replace_thread_summary, -1, &replace_summary[SUMMARY_THREAD], 0);
+        sqlite3_prepare(sqlite_db, stmt_replace_class_summary, -1, &replace_summary[SUMMARY_CLASS], 0);
+        sqlite3_prepare(sqlite_db, stmt_replace_metric, -1, &replace_metric, 0);
+        sqlite3_prepare(sqlite_db, stmt_replace_latency_bucket, -1, &replace_latency_bucket, 0);
+        sqlite3_prepare(sqlite_db, stmt_insert_exception, -1, &insert_exception, 0);
+        sqlite3_prepare(sqlite_db, stmt_replace_exception_summary, -1, &replace_exception_summary, 0);
+        sqlite3_prepare(sqlite_db, stmt_insert_monitor_event, -1, &insert_monitor_event, 0);
+        sqlite3_prepare(sqlite_db, stmt_replace_monitor_site, -1, &replace_monitor_site, 0);
+        sqlite3_prepare(sqlite_db, stmt_replace_monitor_stack, -1, &replace_monitor_stack, 0);
+        sqlite3_prepare(sqlite_db, stmt_insert_allocation, -1, &insert_allocation, 0);
+        sqlite3_prepare(sqlite_db, stmt_replace_allocation_site, -1, &replace_allocation_site, 0);
+        sqlite3_prepare(sqlite_db, stmt_replace_allocation_stack, -1, &replace_allocation_stack, 0);
+        sqlite3_prepare(sqlite_db, stmt_insert_heap_snapshot, -1, &insert_heap_snapshot, 0);
+        sqlite3_prepare(sqlite_db, stmt_insert_heap_class, -1, &insert_heap_class, 0);
+        sqlite3_prepare(sqlite_db, stmt_insert_retention_path, -1, &insert_retention_path, 0);
+        sqlite3_prepare(sqlite_db, stmt_insert_retention_link, -1, &insert_retention_link, 0);
+        sqlite3_prepare(sqlite_db, stmt_select_thread, -1, &select_name[NAME_THREAD], 0);
+        sqlite3_prepare(sqlite_db, stmt_select_class, -1, &select_name[NAME_CLASS], 0);
+        sqlite3_prepare(sqlite_db, stmt_select_method, -1, &select_name[NAME_METHOD], 0);
+        sqlite3_prepare(sqlite_db, stmt_select_signature, -1, &select_name[NAME_SIGNATURE], 0);
+        sqlite3_prepare(sqlite_db, stmt_select_fqn, -1, &select_fqn, 0);
+        sqlite3_prepare(sqlite_db, stmt_select_fqn_class, -1, &select_fqn_class, 0);
     }
 }
 
 // Stolen from SQLite documentation
-void Database::backup(bool isSave) {
+void Database::backup(bool isSave, bool finalize) {
     int rc;                   /* Function return code */
     sqlite3 *pFile;           /* Database connection opened on zFilename */
     sqlite3_backup *pBackup;  /* Backup object used to copy data */
@@ -186,9 +891,87 @@ void Database::backup(bool isSave) {
           (void)sqlite3_backup_finish(pBackup);
         }
         rc = sqlite3_errcode(pTo);
+
+        if (rc == SQLITE_OK && isSave && finalize) {
+            if (SQLITE_OK != sqlite3_exec(pFile, db_finalize, 0, 0, 0)) {
+                cout << "Database::backup- Cannot build the indexes: " << sqlite3_errmsg(pFile) << endl;
+            }
+        }
     }
 
     sqlite3_close(pFile);
 }
 
 
+void Database::checkpoint(bool finalize) {
+    if (!ready())
+        return;
+
+    boost::mutex::scoped_lock lock(checkpoint_mutex);
+    if (checkpoint_running) {
+        checkpoint_pending = true;
+        checkpoint_finalize = checkpoint_finalize || finalize;
+        return;
+    }
+
+    // The previous thread is done, only reap it
+    checkpoint_thread.join();
+    checkpoint_running = true;
+    checkpoint_thread = boost::thread(boost::bind(&Database::run_checkpoint, this, finalize));
+}
+
+
+void Database::wait_checkpoint() {
+    checkpoint_thread.join();
+}
+
+
+void Database::run_checkpoint(bool finalize) {
+    while (true) {
+        incremental_backup(finalize);
+
+        boost::mutex::scoped_lock lock(checkpoint_mutex);
+        if (!checkpoint_pending) {
+            checkpoint_running = false;
+            return;
+        }
+        finalize = checkpoint_finalize;
+        checkpoint_pending = false;
+        checkpoint_finalize = false;
+    }
+}
+
+
+// Copy the in-memory DB by small steps. The source connection is shared with
+// the worker (SQLite serializes the calls), and the pages it writes during the
+// copy are forwarded to the backup by SQLite, so the file ends up with the
+// content of the in-memory DB at the time of the last step.
+void Database::incremental_backup(bool finalize) {
+    sqlite3 *pFile;
+    sqlite3_backup *pBackup;
+
+    int rc = sqlite3_open(backup_path.c_str(), &pFile);
+    if (rc == SQLITE_OK) {
+        pBackup = sqlite3_backup_init(pFile, "main", sqlite_db, "main");
+        if (pBackup) {
+            do {
+                rc = sqlite3_backup_step(pBackup, CHECKPOINT_STEP_PAGES);
+                if (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED)
+                    boost::this_thread::sleep(boost::posix_time::milliseconds(CHECKPOINT_PAUSE_MS));
+            } while (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED);
+            (void)sqlite3_backup_finish(pBackup);
+        }
+        rc = sqlite3_errcode(pFile);
+
+        if (rc != SQLITE_OK) {
+            cout << "Database::incremental_backup- Checkpoint failed: " << sqlite3_errmsg(pFile) << endl;
+        }
+        else if (finalize) {
+            if (SQLITE_OK != sqlite3_exec(pFile, db_finalize, 0, 0, 0)) {
+                cout << "Database::incremental_backup- Cannot build the indexes: " << sqlite3_errmsg(pFile) << endl;
+            }
+        }
+    }
+
+    sqlite3_close(pFile);
+}
@@ -22,26 +22,167 @@
 #include <map>
 #include <string>
 #include <ctime>
+
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+
 #include "config.h"
 #include "sqlite3.h"
 
 
 namespace db {
 
-static const char db_schema[] = "CREATE TABLE IF NOT EXISTS traces (id INTEGER PRIMARY KEY, thread_id INTEGER, fqn_id INTEGER, parent_trace_id INTEGER);\
+// traces: `depth` is the number of recorded callers, and [enter_seq, exit_seq]
+// is the interval of the call so that its subtree is every row of the thread
+// with enter_seq within it (nested sets). `repeat_count` is the number of
+// consecutive identical calls (same subtree) folded in the row, and
+// `transaction_id` the activation of the trigger the call was made under.
+// stacks: one row per distinct call path, the fqn being the top of the path
+// fqns: one row per jmethodID, named once the method is resolved (the names
+// are 0 until then)
+// *_summary: number of calls per fqn/thread/class, with the enter_seq of the
+// first and last of them, maintained by the worker whatever the mode
+// agent_metrics: self-metrics of the agent (memory of its caches, ...)
+// latency_histograms: number of calls of an fqn, per thread group, whose
+// duration (ns) is in [low, high]; the rows of a bucket add up across groups
+// or captures
+// exceptions: one row per thrown exception (MODE_TRACE), with its throw and
+// catch sites (fqn and bytecode index, the catch is 0 when no Java code caught
+// it), the recorded calls around them and the number of frames it unwound
+// exception_summary: throws, catches and unwound frames per throw site and
+// exception class, maintained by the worker whatever the mode
+// monitor_events: one row per time a thread blocked on a monitor (MODE_TRACE),
+// contended enter or wait (`wait` = 1), with the site (fqn and bytecode index)
+// and the closest recorded call; times in ns
+// monitor_sites, monitor_stacks: blocked time per site or call path, monitor
+// class and kind, maintained by the worker whatever the mode
+// allocations: one row per allocation sample (MODE_TRACE), with the class,
+// the size (bytes) and the site, call path and closest recorded call
+// allocation_sites, allocation_stacks: samples and their bytes per site or
+// call path and class, maintained by the worker whatever the mode. A sample
+// stands for about `agent.allocations.interval` bytes (see agent_metrics)
+// heap_snapshots: one row per heap census, with when it ran (JVMTI time, ns),
+// why, how long the VM was stopped for it (ns) and its totals
+// heap_histogram: instances and shallow size (bytes) per class of a census;
+// heap_growth is its difference with the previous census, for the classes of
+// either census (a class gone from the heap has a negative growth)
+// retention_paths: paths from the GC roots to sampled instances of the classes
+// which grew the most at a census (the leak suspects), the identical ones
+// merged: what roots them and how many samples took them. retention_links
+// are the classes along a path from its root (`depth` 0), a run of objects of
+// the same class in one link (`repeat_count` the longest run); a gap in the
+// depths is the middle of a path too long to be kept
+// The dictionaries (threads, classes, methods, signatures, fqns) are indexed
+// from the start: the caches of the worker are bounded, and an evicted name
+// is looked up again instead of being inserted twice. They only get a row per
+// distinct name, unlike `traces`.
+static const char db_schema[] = "CREATE TABLE IF NOT EXISTS traces (id INTEGER PRIMARY KEY, thread_id INTEGER, fqn_id INTEGER, parent_trace_id INTEGER, depth INTEGER, enter_seq INTEGER, exit_seq INTEGER, stack_id INTEGER, repeat_count INTEGER, transaction_id INTEGER);\
+CREATE TABLE IF NOT EXISTS stacks (id INTEGER PRIMARY KEY, parent_stack_id INTEGER, fqn_id INTEGER, depth INTEGER);\
 CREATE TABLE IF NOT EXISTS threads (id INTEGER PRIMARY KEY, thread_name TEXT);\
 CREATE TABLE IF NOT EXISTS fqns (id INTEGER PRIMARY KEY, class_id INTEGER, method_id INTEGER, signature_id INTEGER, jmethod_id INTEGER);\
 CREATE TABLE IF NOT EXISTS classes (id INTEGER PRIMARY KEY, class_name TEXT);\
 CREATE TABLE IF NOT EXISTS methods (id INTEGER PRIMARY KEY, method_name TEXT);\
 CREATE TABLE IF NOT EXISTS signatures (id INTEGER PRIMARY KEY, signature_name TEXT);\
-DELETE FROM traces; DELETE FROM threads; DELETE FROM fqns; DELETE FROM classes; DELETE FROM methods; DELETE FROM signatures;";
+CREATE TABLE IF NOT EXISTS cct_nodes (id INTEGER PRIMARY KEY, thread_id INTEGER, parent_id INTEGER, fqn_id INTEGER, depth INTEGER, calls INTEGER, total_time INTEGER, self_time INTEGER);\
+CREATE TABLE IF NOT EXISTS edges (id INTEGER PRIMARY KEY, caller_fqn_id INTEGER, callee_fqn_id INTEGER, thread_group TEXT, calls INTEGER, total_time INTEGER);\
+CREATE TABLE IF NOT EXISTS fqn_summary (fqn_id INTEGER PRIMARY KEY, calls INTEGER, first_seq INTEGER, last_seq INTEGER);\
+CREATE TABLE IF NOT EXISTS thread_summary (thread_id INTEGER PRIMARY KEY, calls INTEGER, first_seq INTEGER, last_seq INTEGER);\
+CREATE TABLE IF NOT EXISTS class_summary (class_id INTEGER PRIMARY KEY, calls INTEGER, first_seq INTEGER, last_seq INTEGER);\
+CREATE TABLE IF NOT EXISTS agent_metrics (name TEXT PRIMARY KEY, value INTEGER);\
+CREATE TABLE IF NOT EXISTS latency_histograms (fqn_id INTEGER, thread_group TEXT, bucket INTEGER, low INTEGER, high INTEGER, calls INTEGER, PRIMARY KEY (fqn_id, thread_group, bucket));\
+CREATE TABLE IF NOT EXISTS exceptions (id INTEGER PRIMARY KEY, thread_id INTEGER, class_id INTEGER, throw_fqn_id INTEGER, throw_location INTEGER, throw_trace_id INTEGER, catch_fqn_id INTEGER, catch_location INTEGER, catch_trace_id INTEGER, frames_unwound INTEGER, sequence INTEGER, transaction_id INTEGER);\
+CREATE TABLE IF NOT EXISTS exception_summary (throw_fqn_id INTEGER, throw_location INTEGER, class_id INTEGER, throws INTEGER, caught INTEGER, frames_unwound INTEGER, PRIMARY KEY (throw_fqn_id, throw_location, class_id));\
+CREATE TABLE IF NOT EXISTS monitor_events (id INTEGER PRIMARY KEY, thread_id INTEGER, wait INTEGER, class_id INTEGER, site_fqn_id INTEGER, site_location INTEGER, trace_id INTEGER, start_time INTEGER, blocked_time INTEGER, transaction_id INTEGER);\
+CREATE TABLE IF NOT EXISTS monitor_sites (site_fqn_id INTEGER, site_location INTEGER, class_id INTEGER, wait INTEGER, events INTEGER, blocked_time INTEGER, max_blocked_time INTEGER, PRIMARY KEY (site_fqn_id, site_location, class_id, wait));\
+CREATE TABLE IF NOT EXISTS monitor_stacks (stack_id INTEGER, class_id INTEGER, wait INTEGER, events INTEGER, blocked_time INTEGER, max_blocked_time INTEGER, PRIMARY KEY (stack_id, class_id, wait));\
+CREATE TABLE IF NOT EXISTS allocations (id INTEGER PRIMARY KEY, thread_id INTEGER, class_id INTEGER, size INTEGER, site_fqn_id INTEGER, site_location INTEGER, stack_id INTEGER, trace_id INTEGER, time INTEGER, transaction_id INTEGER);\
+CREATE TABLE IF NOT EXISTS allocation_sites (site_fqn_id INTEGER, site_location INTEGER, class_id INTEGER, samples INTEGER, bytes INTEGER, PRIMARY KEY (site_fqn_id, site_location, class_id));\
+CREATE TABLE IF NOT EXISTS allocation_stacks (stack_id INTEGER, class_id INTEGER, samples INTEGER, bytes INTEGER, PRIMARY KEY (stack_id, class_id));\
+CREATE TABLE IF NOT EXISTS heap_snapshots (id INTEGER PRIMARY KEY, time INTEGER, reason TEXT, duration INTEGER, classes INTEGER, instances INTEGER, bytes INTEGER);\
+CREATE TABLE IF NOT EXISTS heap_histogram (snapshot_id INTEGER, class_id INTEGER, instances INTEGER, bytes INTEGER, PRIMARY KEY (snapshot_id, class_id));\
+CREATE VIEW IF NOT EXISTS heap_growth AS SELECT DISTINCT censuses.id AS snapshot_id, ids.class_id AS class_id,\
+ coalesce(current.instances, 0) - coalesce(previous.instances, 0) AS instances, coalesce(current.bytes, 0) - coalesce(previous.bytes, 0) AS bytes\
+ FROM (SELECT id, (SELECT max(earlier.id) FROM heap_snapshots AS earlier WHERE earlier.id < later.id) AS previous_id FROM heap_snapshots AS later) AS censuses\
+ JOIN heap_histogram AS ids ON ids.snapshot_id IN (censuses.id, censuses.previous_id)\
+ LEFT JOIN heap_histogram AS current ON current.snapshot_id = censuses.id AND current.class_id = ids.class_id\
+ LEFT JOIN heap_histogram AS previous ON previous.snapshot_id = censuses.previous_id AND previous.class_id = ids.class_id;\
+CREATE TABLE IF NOT EXISTS retention_paths (id INTEGER PRIMARY KEY, snapshot_id INTEGER, class_id INTEGER, root TEXT, samples INTEGER);\
+CREATE TABLE IF NOT EXISTS retention_links (path_id INTEGER, depth INTEGER, class_id INTEGER, repeat_count INTEGER, PRIMARY KEY (path_id, depth));\
+CREATE INDEX IF NOT EXISTS threads_name ON threads (thread_name);\
+CREATE INDEX IF NOT EXISTS classes_name ON classes (class_name);\
+CREATE INDEX IF NOT EXISTS methods_name ON methods (method_name);\
+CREATE INDEX IF NOT EXISTS signatures_name ON signatures (signature_name);\
+CREATE INDEX IF NOT EXISTS fqns_jmethod_id ON fqns (jmethod_id);\
+DELETE FROM traces; DELETE FROM threads; DELETE FROM fqns; DELETE FROM classes; DELETE FROM methods; DELETE FROM signatures;\
+DELETE FROM cct_nodes; DELETE FROM edges; DELETE FROM stacks;\
+DELETE FROM fqn_summary; DELETE FROM thread_summary; DELETE FROM class_summary; DELETE FROM agent_metrics;\
+DELETE FROM latency_histograms; DELETE FROM exceptions; DELETE FROM exception_summary;\
+DELETE FROM monitor_events; DELETE FROM monitor_sites; DELETE FROM monitor_stacks;\
+DELETE FROM allocations; DELETE FROM allocation_sites; DELETE FROM allocation_stacks;\
+DELETE FROM heap_snapshots; DELETE FROM heap_histogram; DELETE FROM retention_paths; DELETE FROM retention_links;";
+
+// The analysis indexes are only built on the dumped DB (never on the
+// in-memory one) so that the ingest stays append-only. The indexes of the
+// name dictionaries are the exception: `db_schema` builds them up front, for
+// the lookups of the names evicted from the worker caches.
+static const char db_finalize[] = "CREATE INDEX IF NOT EXISTS traces_thread_id ON traces (thread_id, id);\
+CREATE INDEX IF NOT EXISTS traces_fqn_id ON traces (fqn_id);\
+CREATE INDEX IF NOT EXISTS traces_transaction_id ON traces (transaction_id);\
+CREATE INDEX IF NOT EXISTS fqns_class_method ON fqns (class_id, method_id);\
+CREATE INDEX IF NOT EXISTS edges_callee ON edges (callee_fqn_id);\
+CREATE INDEX IF NOT EXISTS exceptions_throw ON exceptions (throw_fqn_id, class_id);\
+ANALYZE;";
 
-static const char stmt_insert_trace[] = "INSERT INTO traces VALUES (NULL, ?, ?, ?);";
+static const char stmt_insert_trace[] = "INSERT INTO traces VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?);";
+// The flight rings and the tail sampling send the stack with every entry
+static const char stmt_insert_stack[] = "INSERT OR IGNORE INTO stacks VALUES (?, ?, ?, ?);";
+static const char stmt_update_trace_exit[] = "UPDATE traces SET exit_seq = ? WHERE id = ?;";
 static const char stmt_insert_thread[] = "INSERT INTO threads VALUES (NULL, ?);";
 static const char stmt_insert_fqn[] = "INSERT INTO fqns VALUES (NULL, ?, ?, ?, ?);";
+static const char stmt_update_fqn_names[] = "UPDATE fqns SET class_id = ?, method_id = ?, signature_id = ? WHERE id = ?;";
 static const char stmt_insert_class[] = "INSERT INTO classes VALUES (NULL, ?);";
 static const char stmt_insert_method[] = "INSERT INTO methods VALUES (NULL, ?);";
 static const char stmt_insert_signature[] = "INSERT INTO signatures VALUES (NULL, ?);";
+static const char stmt_replace_cct_node[] = "INSERT OR REPLACE INTO cct_nodes VALUES (?, ?, ?, ?, ?, ?, ?, ?);";
+static const char stmt_replace_edge[] = "INSERT OR REPLACE INTO edges VALUES (?, ?, ?, ?, ?, ?);";
+static const char stmt_replace_fqn_summary[] = "INSERT OR REPLACE INTO fqn_summary VALUES (?, ?, ?, ?);";
+static const char stmt_replace_thread_summary[] = "INSERT OR REPLACE INTO thread_summary VALUES (?, ?, ?, ?);";
+static const char stmt_replace_class_summary[] = "INSERT OR REPLACE INTO class_summary VALUES (?, ?, ?, ?);";
+static const char stmt_replace_latency_bucket[] = "INSERT OR REPLACE INTO latency_histograms VALUES (?, ?, ?, ?, ?, ?);";
+static const char stmt_insert_exception[] = "INSERT INTO exceptions VALUES (NULL, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);";
+static const char stmt_replace_exception_summary[] = "INSERT OR REPLACE INTO exception_summary VALUES (?, ?, ?, ?, ?, ?);";
+static const char stmt_insert_monitor_event[] = "INSERT INTO monitor_events VALUES (NULL, ?, ?, ?, ?, ?, ?, ?, ?, ?);";
+static const char stmt_replace_monitor_site[] = "INSERT OR REPLACE INTO monitor_sites VALUES (?, ?, ?, ?, ?, ?, ?);";
+static const char stmt_replace_monitor_stack[] = "INSERT OR REPLACE INTO monitor_stacks VALUES (?, ?, ?, ?, ?, ?);";
+static const char stmt_insert_allocation[] = "INSERT INTO allocations VALUES (NULL, ?, ?, ?, ?, ?, ?, ?, ?, ?);";
+static const char stmt_replace_allocation_site[] = "INSERT OR REPLACE INTO allocation_sites VALUES (?, ?, ?, ?, ?);";
+static const char stmt_replace_allocation_stack[] = "INSERT OR REPLACE INTO allocation_stacks VALUES (?, ?, ?, ?);";
+static const char stmt_insert_heap_snapshot[] = "INSERT INTO heap_snapshots VALUES (NULL, ?, ?, ?, ?, ?, ?);";
+static const char stmt_insert_heap_class[] = "INSERT INTO heap_histogram VALUES (?, ?, ?, ?);";
+static const char stmt_insert_retention_path[] = "INSERT INTO retention_paths VALUES (NULL, ?, ?, ?, ?);";
+static const char stmt_insert_retention_link[] = "INSERT INTO retention_links VALUES (?, ?, ?, ?);";
+static const char stmt_replace_metric[] = "INSERT OR REPLACE INTO agent_metrics VALUES (?, ?);";
+static const char stmt_select_thread[] = "SELECT id FROM threads WHERE thread_name = ? LIMIT 1;";
+static const char stmt_select_class[] = "SELECT id FROM classes WHERE class_name = ? LIMIT 1;";
+static const char stmt_select_method[] = "SELECT id FROM methods WHERE method_name = ? LIMIT 1;";
+static const char stmt_select_signature[] = "SELECT id FROM signatures WHERE signature_name = ? LIMIT 1;";
+static const char stmt_select_fqn[] = "SELECT id FROM fqns WHERE jmethod_id = ? LIMIT 1;";
+static const char stmt_select_fqn_class[] = "SELECT class_id FROM fqns WHERE id = ?;";
+
+// Summary tables, see `summary`
+enum SummaryKind {
+    SUMMARY_FQN,
+    SUMMARY_THREAD,
+    SUMMARY_CLASS
+};
+
+// Dictionaries of names, see `find_name`
+enum NameKind {
+    NAME_THREAD,
+    NAME_CLASS,
+    NAME_METHOD,
+    NAME_SIGNATURE
+};
 
 
 class Database {
@@ -52,18 +193,51 @@ class Database {
     sqlite3* sqlite_db;
 
     sqlite3_stmt* insert_trace;
+    sqlite3_stmt* update_trace_exit;
+    sqlite3_stmt* insert_stack;
     sqlite3_stmt* insert_thread;
     sqlite3_stmt* insert_fqn;
+    sqlite3_stmt* update_fqn_names;
     sqlite3_stmt* insert_class;
     sqlite3_stmt* insert_method;
     sqlite3_stmt* insert_signature;
+    sqlite3_stmt* replace_cct_node;
+    sqlite3_stmt* replace_edge;
+    sqlite3_stmt* replace_summary[3];
+    sqlite3_stmt* replace_metric;
+    sqlite3_stmt* replace_latency_bucket;
+    sqlite3_stmt* insert_exception;
+    sqlite3_stmt* replace_exception_summary;
+    sqlite3_stmt* insert_monitor_event;
+    sqlite3_stmt* replace_monitor_site;
+    sqlite3_stmt* replace_monitor_stack;
+    sqlite3_stmt* insert_allocation;
+    sqlite3_stmt* replace_allocation_site;
+    sqlite3_stmt* replace_allocation_stack;
+    sqlite3_stmt* insert_heap_snapshot;
+    sqlite3_stmt* insert_heap_class;
+    sqlite3_stmt* insert_retention_path;
+    sqlite3_stmt* insert_retention_link;
+    sqlite3_stmt* select_name[4];
+    sqlite3_stmt* select_fqn;
+    sqlite3_stmt* select_fqn_class;
+
+    // Background checkpoint: a request made while one runs is coalesced in
+    // `checkpoint_pending` and served when the current one is done
+    boost::thread checkpoint_thread;
+    boost::mutex checkpoint_mutex;
+    bool checkpoint_running;
+    bool checkpoint_pending;
+    bool checkpoint_finalize;
 
   private:
     void create_schema();
 
     std::string trace_time() const;
     
-    void backup(bool isSave=true);
+    void backup(bool isSave=true, bool finalize=false);
+    void incremental_backup(bool finalize);
+    void run_checkpoint(bool finalize);
 
     Database(const Database& _p) {}
     Database& operator=(const Database& _p) {
@@ -78,22 +252,85 @@ class Database {
         backup_path = db_name;
     }
 
-    inline void save() {
-        backup();
+    // Persist the in-memory DB; the finalized dump also gets the indexes
+    // needed by the analysis scripts
+    inline void save(bool finalize=false) {
+        wait_checkpoint();
+        backup(true, finalize);
     }
 
+    // Same as save() but from a background thread, copying a few pages at a
+    // time so that the writers of the in-memory DB are never stalled. Returns
+    // right away.
+    void checkpoint(bool finalize=false);
+    void wait_checkpoint();
+
     // Can we use the database? If not, it's okay.. we'll just
     // don't persist anything!
     inline bool ready() const {
         return usable;
     }
 
-    unsigned int thread(const std::string& thread_name);
-    unsigned int method(const std::string& method_name);
-    unsigned int clazz(const std::string& class_name);
-    unsigned int signature(const std::string& signature_name);
-    unsigned int fqn(const unsigned int class_id, const unsigned int method_id, const unsigned int signature_id, const unsigned int jmethod_id);
-    unsigned int trace(const unsigned int thread_id, const unsigned int fqn_id, const unsigned long long parent_trace_id=0);
+    // Group the writes of a flush of the aggregates
+    void begin();
+    void commit();
+
+    unsigned long long thread(const std::string& thread_name);
+    unsigned long long method(const std::string& method_name);
+    unsigned long long clazz(const std::string& class_name);
+    unsigned long long signature(const std::string& signature_name);
+    unsigned long long fqn(const unsigned long long class_id, const unsigned long long method_id, const unsigned long long signature_id, const unsigned long long jmethod_id);
+    bool fqn_names(const unsigned long long fqn_id, const unsigned long long class_id, const unsigned long long method_id, const unsigned long long signature_id);
+    unsigned long long trace(const unsigned long long trace_id, const unsigned long long thread_id, const unsigned long long fqn_id, 
+                             const unsigned long long parent_trace_id, const unsigned int depth, const unsigned long long enter_seq,
+                             const unsigned long long stack_id, const unsigned long long transaction_id,
+                             const unsigned long long exit_seq=0, const unsigned long long repeat_count=1);
+    bool stack(const unsigned long long stack_id, const unsigned long long parent_stack_id, const unsigned long long fqn_id, const unsigned int depth);
+    bool trace_exit(const unsigned long long trace_id, const unsigned long long exit_seq);
+    bool cct_node(const unsigned long long node_id, const unsigned long long thread_id, const unsigned long long parent_id,
+                  const unsigned long long fqn_id, const unsigned int depth, const unsigned long long calls,
+                  const unsigned long long total_time, const unsigned long long self_time);
+    bool edge(const unsigned long long edge_id, const unsigned long long caller_fqn_id, const unsigned long long callee_fqn_id,
+              const std::string& thread_group, const unsigned long long calls, const unsigned long long total_time);
+    bool summary(const SummaryKind kind, const unsigned long long key_id, const unsigned long long calls,
+                 const unsigned long long first_seq, const unsigned long long last_seq);
+    bool metric(const std::string& name, const unsigned long long value);
+    bool latency_bucket(const unsigned long long fqn_id, const std::string& thread_group, const unsigned long long bucket,
+                        const unsigned long long low, const unsigned long long high, const unsigned long long calls);
+    bool exception(const unsigned long long thread_id, const unsigned long long class_id,
+                   const unsigned long long throw_fqn_id, const long long throw_location, const unsigned long long throw_trace_id,
+                   const unsigned long long catch_fqn_id, const long long catch_location, const unsigned long long catch_trace_id,
+                   const unsigned int frames_unwound, const unsigned long long sequence, const unsigned long long transaction_id);
+    bool exception_summary(const unsigned long long throw_fqn_id, const long long throw_location, const unsigned long long class_id,
+                           const unsigned long long throws, const unsigned long long caught, const unsigned long long frames_unwound);
+    bool monitor_event(const unsigned long long thread_id, const bool wait, const unsigned long long class_id,
+                       const unsigned long long site_fqn_id, const long long site_location, const unsigned long long trace_id,
+                       const unsigned long long start_time, const unsigned long long blocked_time, const unsigned long long transaction_id);
+    bool monitor_site(const unsigned long long site_fqn_id, const long long site_location, const unsigned long long class_id, const bool wait,
+                      const unsigned long long events, const unsigned long long blocked_time, const unsigned long long max_blocked_time);
+    bool monitor_stack(const unsigned long long stack_id, const unsigned long long class_id, const bool wait,
+                       const unsigned long long events, const unsigned long long blocked_time, const unsigned long long max_blocked_time);
+    bool allocation(const unsigned long long thread_id, const unsigned long long class_id, const unsigned long long size,
+                    const unsigned long long site_fqn_id, const long long site_location, const unsigned long long stack_id,
+                    const unsigned long long trace_id, const unsigned long long time, const unsigned long long transaction_id);
+    bool allocation_site(const unsigned long long site_fqn_id, const long long site_location, const unsigned long long class_id,
+                         const unsigned long long samples, const unsigned long long bytes);
+    bool allocation_stack(const unsigned long long stack_id, const unsigned long long class_id,
+                          const unsigned long long samples, const unsigned long long bytes);
+    unsigned long long heap_snapshot(const unsigned long long time, const std::string& reason, const unsigned long long duration,
+                                     const unsigned long long classes, const unsigned long long instances, const unsigned long long bytes);
+    bool heap_class(const unsigned long long snapshot_id, const unsigned long long class_id,
+                    const unsigned long long instances, const unsigned long long bytes);
+    unsigned long long retention_path(const unsigned long long snapshot_id, const unsigned long long class_id,
+                                      const std::string& root, const unsigned long long samples);
+    bool retention_link(const unsigned long long path_id, const unsigned int depth, const unsigned long long class_id,
+                        const unsigned long long repeat_count);
+
+    // Lookups for the names evicted from the caches of the worker; 0 when
+    // the name is not in the DB
+    unsigned long long find_name(const NameKind kind, const std::string& name);
+    unsigned long long find_fqn(const unsigned long long jmethod_id);
+    unsigned long long fqn_class(const unsigned long long fqn_id);
 
 };
 
@@ -0,0 +1,42 @@
+/*
+  Java JVMTI Trace Extraction
+  by Romain Gaucher <r@rgaucher.info> - http://rgaucher.info
+
+  Copyright (c) 2011-2012 Romain Gaucher <r@rgaucher.info>
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#include "flight.h"
+
+using namespace std;
+
+
+// The oldest events of the ring may be the exits of calls that were
+// overwritten, or entries whose stack was first seen in an overwritten event:
+// the exits update no row, and every entry carries its stack (the stacks
+// already in the DB are kept)
+size_t FlightRing::drain(TraceStore& store, const string& thread_name) {
+    unsigned long long first = head > records.size() ? head - records.size() : 0;
+
+    for (unsigned long long index=first; index<head; index++) {
+        TraceEvent e;
+        fill_event(records[index % records.size()], e);
+        e.thread_name = thread_name;
+        e.new_stack = e.kind == TRACE_ENTRY;
+        store.push(e);
+    }
+
+    size_t drained = head - first;
+    head = 0;
+    return drained;
+}
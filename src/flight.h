@@ -0,0 +1,58 @@
+/*
+  Java JVMTI Trace Extraction
+  by Romain Gaucher <r@rgaucher.info> - http://rgaucher.info
+
+  Copyright (c) 2011-2012 Romain Gaucher <r@rgaucher.info>
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef __FLIGHT_H
+#define __FLIGHT_H
+
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "store.h"
+#include "journal.h"
+
+
+// Flight recorder: instead of going to the worker, the recorded events of a
+// thread are written over the oldest ones in a fixed-size ring (same records
+// as the crash journal). Nothing reads the rings until a trigger fires; the
+// rings are then drained to the store, oldest event first, and the DB gets
+// the context of the incident.
+class FlightRing {
+    std::vector<JournalRecord> records;
+    unsigned long long head;            // number of events ever written
+
+  public:
+    FlightRing(const std::size_t capacity)
+     : records(capacity), head(0) {
+    }
+
+    void append(const TraceEvent& e, const unsigned int thread_no) {
+        fill_record(e, thread_no, records[head % records.size()]);
+        head++;
+    }
+
+    bool empty() const {
+        return head == 0;
+    }
+
+    // Push the events kept in the ring to the store and empty the ring;
+    // returns the number of events pushed
+    std::size_t drain(TraceStore&, const std::string& thread_name);
+};
+
+#endif
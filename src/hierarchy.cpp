@@ -0,0 +1,216 @@
+/*
+  Java JVMTI Trace Extraction
+  by Romain Gaucher <r@rgaucher.info> - http://rgaucher.info
+
+  Copyright (c) 2011-2012 Romain Gaucher <r@rgaucher.info>
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#include <climits>
+
+#include "hierarchy.h"
+#include "symbolizer.h"
+#include "cache.h"
+
+using namespace std;
+
+static const unsigned int word_bits = sizeof(unsigned long) * CHAR_BIT;
+
+// Signature of the free slots
+static const string free_signature("?");
+
+
+void InterfaceSet::set(const unsigned int bit) {
+    if (words.size() <= bit / word_bits)
+        words.resize(bit / word_bits + 1, 0);
+    words[bit / word_bits] |= 1UL << (bit % word_bits);
+}
+
+
+bool InterfaceSet::test(const unsigned int bit) const {
+    if (words.size() <= bit / word_bits)
+        return false;
+    return (words[bit / word_bits] >> (bit % word_bits)) & 1UL;
+}
+
+
+void InterfaceSet::merge(const InterfaceSet& other) {
+    if (words.size() < other.words.size())
+        words.resize(other.words.size(), 0);
+    for (size_t i=0; i<other.words.size(); i++) {
+        words[i] |= other.words[i];
+    }
+}
+
+
+unsigned int ClassHierarchy::interface_bit(const string& signature) {
+    map<string, unsigned int>::const_iterator iter = interface_bits.find(signature);
+    if (iter != interface_bits.end())
+        return iter->second;
+
+    unsigned int bit = interface_bits.size();
+    interface_bits[signature] = bit;
+    return bit;
+}
+
+
+unsigned int ClassHierarchy::add(jvmtiEnv* jvmti, JNIEnv* jni, jclass klass) {
+    jlong tag = 0;
+    jvmti->GetTag(klass, &tag);
+
+    // A retention walk tags the mirror of a class not tagged yet as any other
+    // object, with its node: the class is not in the hierarchy
+    if (tag & OBJECT_RETAINED)
+        tag = 0;
+    if (tag_index(tag))
+        return tag_index(tag);
+
+    ClassNode node;
+    node.superclass = 0;
+    node.loader = loader_number(jvmti, jni, klass);
+    node.unloaded = false;
+
+    string class_signature, generic;
+    get_classname(jvmti, klass, class_signature, generic);
+
+    jclass superclass = jni->GetSuperclass(klass);
+    if (superclass) {
+        node.superclass = add(jvmti, jni, superclass);
+        node.interfaces = classes[node.superclass].interfaces;
+        jni->DeleteLocalRef(superclass);
+    }
+
+    jint interface_count = 0;
+    jclass* interfaces = 0;
+    if (JVMTI_ERROR_NONE == jvmti->GetImplementedInterfaces(klass, &interface_count, &interfaces)) {
+        for (jint i=0; i<interface_count; i++) {
+            unsigned int interface_index = add(jvmti, jni, interfaces[i]);
+            node.interfaces.merge(classes[interface_index].interfaces);
+            node.interfaces.set(interface_bit(signature(interface_index)));
+            jni->DeleteLocalRef(interfaces[i]);
+        }
+        jvmti->Deallocate(reinterpret_cast<unsigned char*>(interfaces));
+    }
+
+    unsigned int class_index = classes.size();
+    if (!free_slots.empty()) {
+        class_index = free_slots.back();
+        free_slots.pop_back();
+    }
+
+    SignatureEntry entry = {0, 0};
+    SignatureIndex::iterator loaded = loaded_classes.insert(make_pair(class_signature, entry)).first;
+    loaded->second.class_index = class_index;
+    loaded->second.classes++;
+    node.signature = &loaded->first;
+    if (class_index < classes.size())
+        classes[class_index] = node;
+    else
+        classes.push_back(node);
+
+    jvmti->SetTag(klass, make_tag(class_index, tag));
+    return class_index;
+}
+
+
+// Loaders are numbered in their own tag
+unsigned int ClassHierarchy::loader_number(jvmtiEnv* jvmti, JNIEnv* jni, jclass klass) {
+    jobject class_loader = 0;
+    if (JVMTI_ERROR_NONE != jvmti->GetClassLoader(klass, &class_loader) || !class_loader)
+        return 0;
+
+    jlong tag = 0;
+    jvmti->GetTag(class_loader, &tag);
+    if (!(tag & CLASS_LOADER)) {
+        tag = make_tag(++loader_counter, CLASS_LOADER);
+        jvmti->SetTag(class_loader, tag);
+    }
+    jni->DeleteLocalRef(class_loader);
+    return tag_index(tag);
+}
+
+
+unsigned int ClassHierarchy::find(const string& signature) const {
+    SignatureIndex::const_iterator iter = loaded_classes.find(signature);
+    if (iter == loaded_classes.end())
+        return 0;
+    return iter->second.class_index;
+}
+
+
+void ClassHierarchy::unload(const unsigned int class_index) {
+    if (!class_index || class_index >= classes.size() || classes[class_index].unloaded)
+        return;
+
+    ClassNode& node = classes[class_index];
+    node.unloaded = true;
+    vector<unsigned long>().swap(node.interfaces.words);
+
+    SignatureIndex::iterator loaded = loaded_classes.find(*node.signature);
+    if (loaded != loaded_classes.end() && loaded->second.class_index == class_index)
+        loaded->second.class_index = 0;
+    unloaded_slots.push_back(class_index);
+}
+
+
+void ClassHierarchy::recycle(vector<unsigned int>& recycled) {
+    for (vector<unsigned int>::const_iterator iter=unloaded_slots.begin(); iter!=unloaded_slots.end(); ++iter) {
+        ClassNode& node = classes[*iter];
+
+        // Drop the (interned) signature unless another class uses it
+        SignatureIndex::iterator loaded = loaded_classes.find(*node.signature);
+        if (loaded != loaded_classes.end() && !--loaded->second.classes)
+            loaded_classes.erase(loaded);
+        node.signature = &free_signature;
+        node.superclass = 0;
+
+        free_slots.push_back(*iter);
+        recycled.push_back(*iter);
+    }
+    unloaded_slots.clear();
+}
+
+
+size_t ClassHierarchy::memory() const {
+    size_t bytes = classes.capacity() * sizeof(ClassNode)
+                 + (unloaded_slots.capacity() + free_slots.capacity()) * sizeof(unsigned int);
+    for (vector<ClassNode>::const_iterator iter=classes.begin(); iter!=classes.end(); ++iter) {
+        bytes += iter->interfaces.words.capacity() * sizeof(unsigned long);
+    }
+    for (SignatureIndex::const_iterator iter=loaded_classes.begin(); iter!=loaded_classes.end(); ++iter) {
+        bytes += sizeof(SignatureIndex::value_type) + 4 * sizeof(void*) + heap_bytes(iter->first);
+    }
+    for (map<string, unsigned int>::const_iterator iter=interface_bits.begin(); iter!=interface_bits.end(); ++iter) {
+        bytes += sizeof(map<string, unsigned int>::value_type) + 4 * sizeof(void*) + heap_bytes(iter->first);
+    }
+    return bytes;
+}
+
+
+bool ClassHierarchy::implements(const unsigned int class_index, const unsigned int bit) const {
+    if (!class_index || class_index >= classes.size())
+        return false;
+    return classes[class_index].interfaces.test(bit);
+}
+
+
+bool ClassHierarchy::subclass_of(const unsigned int class_index, const unsigned int ancestor_index) const {
+    if (!ancestor_index || class_index >= classes.size())
+        return false;
+
+    for (unsigned int current=class_index; current; current=classes[current].superclass) {
+        if (current == ancestor_index)
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,151 @@
+/*
+  Java JVMTI Trace Extraction
+  by Romain Gaucher <r@rgaucher.info> - http://rgaucher.info
+
+  Copyright (c) 2011-2012 Romain Gaucher <r@rgaucher.info>
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef __HIERARCHY_H
+#define __HIERARCHY_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <jvmti.h>
+
+#include "config.h"
+
+
+// Tag of a class: the index of the class in the hierarchy, and the verdicts
+// of the agent in the low bits
+enum ClassTagFlags {
+    CLASS_TAGGED = 1,           // the verdicts are computed
+    CLASS_FILTERED = 2,
+    CLASS_SERIALIZABLE = 4,
+    CLASS_LOADER = 8,           // not a class: a class loader, by loader number
+    CLASS_TRIGGER = 16,         // some of its methods may be triggers
+    OBJECT_RETAINED = 32        // not a class: an object reached by a retention walk, by node
+};
+
+static const int class_index_shift = 8;
+
+
+// Set of interfaces, one bit per interface (see ClassHierarchy::interface_bit)
+struct InterfaceSet {
+    std::vector<unsigned long> words;
+
+    void set(const unsigned int bit);
+    bool test(const unsigned int bit) const;
+    void merge(const InterfaceSet&);
+};
+
+
+// Classes seen by the agent, with their superclass and every interface they
+// implement (directly, through their superinterfaces, or through their
+// superclasses). Built when the classes are prepared, so that the queries
+// are only a few lookups. The signatures are interned: the classes of the
+// same name (different loaders) share the string. The slot of an unloaded
+// class is given to a later class once recycled, so the hierarchy follows the
+// loaded classes and not every class ever loaded.
+class ClassHierarchy {
+    struct SignatureEntry {
+        unsigned int class_index;       // last class loaded with it, 0 when unloaded
+        unsigned int classes;           // slots sharing the string
+    };
+
+    typedef std::map<std::string, SignatureEntry> SignatureIndex;
+
+    struct ClassNode {
+        const std::string* signature;
+        unsigned int superclass;        // index, 0 for none
+        unsigned int loader;            // loader number, 0 for the bootstrap loader
+        bool unloaded;
+        InterfaceSet interfaces;
+    };
+
+    // classes[0] is unused: index 0 is "not in the hierarchy"
+    std::vector<ClassNode> classes;
+    std::map<std::string, unsigned int> interface_bits;
+
+    // signature -> index of the last class loaded with it
+    SignatureIndex loaded_classes;
+    unsigned int loader_counter;
+
+    // Slots of the unloaded classes, until recycled (they keep their
+    // signature meanwhile), then free for the next classes
+    std::vector<unsigned int> unloaded_slots;
+    std::vector<unsigned int> free_slots;
+
+  private:
+    unsigned int loader_number(jvmtiEnv*, JNIEnv*, jclass);
+
+  public:
+    ClassHierarchy()
+     : classes(1), loader_counter(0) {
+    }
+
+    // Index of a class, adding it (and its ancestors) to the hierarchy if
+    // needed; the index is kept in the tag of the class
+    unsigned int add(jvmtiEnv*, JNIEnv*, jclass);
+
+    // Bit of an interface, by signature; the interface does not need to be
+    // loaded yet
+    unsigned int interface_bit(const std::string& signature);
+
+    bool implements(const unsigned int class_index, const unsigned int bit) const;
+    bool subclass_of(const unsigned int class_index, const unsigned int ancestor_index) const;
+
+    // Index of the loaded class with this signature, 0 when there is none
+    unsigned int find(const std::string& signature) const;
+
+    // The class was unloaded (its tag was freed); its index is reused once
+    // recycled
+    void unload(const unsigned int class_index);
+
+    // Free the slots of the classes unloaded since the last call, and append
+    // them to `recycled`: the caller must not hold their index anymore (e.g.
+    // in a heap census)
+    void recycle(std::vector<unsigned int>& recycled);
+
+    const std::string& signature(const unsigned int class_index) const {
+        return *classes[class_index].signature;
+    }
+
+    unsigned int loader(const unsigned int class_index) const {
+        return classes[class_index].loader;
+    }
+
+    // Number of slots: the indexes are below size() + 1
+    std::size_t size() const {
+        return classes.size() - 1;
+    }
+
+    std::size_t loaded() const {
+        return size() - unloaded_slots.size() - free_slots.size();
+    }
+
+    // Memory of the nodes, the interface sets and the interned signatures
+    std::size_t memory() const;
+
+    static unsigned int tag_index(const jlong tag) {
+        return static_cast<unsigned int>(tag >> class_index_shift);
+    }
+
+    static jlong make_tag(const unsigned int class_index, const jlong flags) {
+        return (static_cast<jlong>(class_index) << class_index_shift) | flags;
+    }
+};
+
+#endif
@@ -0,0 +1,186 @@
+/*
+  Java JVMTI Trace Extraction
+  by Romain Gaucher <r@rgaucher.info> - http://rgaucher.info
+
+  Copyright (c) 2011-2012 Romain Gaucher <r@rgaucher.info>
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#include <iostream>
+#include <sstream>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "journal.h"
+
+using namespace std;
+
+
+bool EventJournal::open(const string& path, const unsigned long long capacity) {
+    if (ready() || capacity == 0)
+        return false;
+
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        cout << "EventJournal::open- Cannot create the journal at: " << path << endl;
+        return false;
+    }
+
+    mapped_size = journal_records_offset + capacity * sizeof(JournalRecord);
+    if (ftruncate(fd, mapped_size) != 0) {
+        cout << "EventJournal::open- Cannot allocate " << mapped_size << " bytes for the journal" << endl;
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+
+    void* mapping = mmap(0, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        cout << "EventJournal::open- Cannot map the journal" << endl;
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+
+    string symbols_path = path + ".symbols";
+    symbols_fd = ::open(symbols_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (symbols_fd < 0)
+        cout << "EventJournal::open- Cannot create the symbols at: " << symbols_path << endl;
+
+    header = static_cast<JournalHeader*>(mapping);
+    records = reinterpret_cast<JournalRecord*>(static_cast<char*>(mapping) + journal_records_offset);
+
+    memcpy(header->magic, journal_magic, sizeof(journal_magic));
+    header->record_size = sizeof(JournalRecord);
+    header->capacity = capacity;
+    header->head = 0;
+    header->state = JOURNAL_OPEN;
+    return true;
+}
+
+
+// The symbols are written straight to the file (no stdio buffer), so that
+// they are in the OS as soon as the records that use them
+void EventJournal::write_symbol(const string& line) {
+    if (symbols_fd < 0)
+        return;
+
+    const char* buffer = line.c_str();
+    size_t remaining = line.size();
+    while (remaining > 0) {
+        ssize_t written = ::write(symbols_fd, buffer, remaining);
+        if (written <= 0)
+            return;
+        buffer += written;
+        remaining -= written;
+    }
+}
+
+
+void EventJournal::thread(const unsigned int thread_no, const string& thread_name) {
+    if (!ready())
+        return;
+
+    ostringstream line;
+    line << "T\t" << thread_no << '\t' << thread_name << '\n';
+    write_symbol(line.str());
+}
+
+
+void EventJournal::method(const unsigned long long method_id, const string& class_name,
+                          const string& method_name, const string& signature_name) {
+    if (!ready())
+        return;
+
+    ostringstream line;
+    line << "M\t" << method_id << '\t' << class_name << '\t' << method_name << '\t' << signature_name << '\n';
+    write_symbol(line.str());
+}
+
+
+void EventJournal::append(const TraceEvent& e, const unsigned int thread_no) {
+    if (!ready())
+        return;
+
+    unsigned long long index = header->head;
+    JournalRecord* record = &records[index % header->capacity];
+
+    record->stamp = 0;
+    fill_record(e, thread_no, *record);
+
+    // The record must be complete before it is stamped
+    __sync_synchronize();
+    record->stamp = index + 1;
+
+    header->head = index + 1;
+}
+
+
+void fill_record(const TraceEvent& e, const unsigned int thread_no, JournalRecord& record) {
+    record.trace_id = e.trace_id;
+    record.parent_trace_id = e.parent_trace_id;
+    record.sequence = e.sequence;
+    record.timestamp = e.timestamp;
+    record.stack_id = e.stack_id;
+    record.parent_stack_id = e.parent_stack_id;
+    record.method_id = e.method_id;
+    record.transaction_id = e.transaction_id;
+    record.thread_no = thread_no;
+    record.depth = e.depth;
+    record.kind = e.kind;
+    record.flags = e.unwound ? journal_unwound : 0;
+}
+
+
+void fill_event(const JournalRecord& record, TraceEvent& e) {
+    e.kind = static_cast<TraceEventKind>(record.kind);
+    e.trace_id = record.trace_id;
+    e.parent_trace_id = record.parent_trace_id;
+    e.sequence = record.sequence;
+    e.timestamp = record.timestamp;
+    e.stack_id = record.stack_id;
+    e.parent_stack_id = record.parent_stack_id;
+    e.method_id = record.method_id;
+    e.transaction_id = record.transaction_id;
+    e.thread_no = record.thread_no;
+    e.depth = record.depth;
+    e.unwound = (record.flags & journal_unwound) != 0;
+}
+
+
+void EventJournal::seal() {
+    if (header)
+        header->state = JOURNAL_CRASHED;
+}
+
+
+void EventJournal::close(bool clean) {
+    if (!ready())
+        return;
+
+    if (clean)
+        header->state = JOURNAL_CLEAN;
+
+    msync(header, mapped_size, MS_SYNC);
+    munmap(header, mapped_size);
+    ::close(fd);
+    if (symbols_fd >= 0)
+        ::close(symbols_fd);
+
+    header = 0;
+    records = 0;
+    fd = symbols_fd = -1;
+}
@@ -0,0 +1,125 @@
+/*
+  Java JVMTI Trace Extraction
+  by Romain Gaucher <r@rgaucher.info> - http://rgaucher.info
+
+  Copyright (c) 2011-2012 Romain Gaucher <r@rgaucher.info>
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef __JOURNAL_H
+#define __JOURNAL_H
+
+#include <string>
+
+#include "config.h"
+#include "store.h"
+
+
+// Crash journal: the recorded events are also written to a ring of fixed-size
+// records in a memory-mapped file. The pages belong to the OS as soon as they
+// are written, so the last `capacity` events survive a crash or a kill of the
+// JVM, even when the in-memory DB and the queue are lost. The names of the
+// threads and methods go to a side file (`<path>.symbols`) the first time
+// they are seen. `viewdb.py --recover` rebuilds a DB from both files.
+
+static const char journal_magic[8] = {'J', 'T', 'R', 'A', 'C', 'E', 'J', '2'};
+
+enum JournalState {
+    JOURNAL_OPEN,       // being written (or the process was killed)
+    JOURNAL_CLEAN,      // everything made it to the DB
+    JOURNAL_CRASHED     // sealed by the fatal signal handler
+};
+
+struct JournalHeader {
+    char magic[8];
+    unsigned long long record_size;
+    unsigned long long capacity;
+    unsigned long long head;            // number of records ever written
+    unsigned long long state;
+};
+
+// `stamp` is the index of the record + 1, and is only set once the record is
+// complete, so that a record torn by a crash is skipped by the recovery
+struct JournalRecord {
+    unsigned long long stamp;
+    unsigned long long trace_id;
+    unsigned long long parent_trace_id;
+    unsigned long long sequence;
+    unsigned long long timestamp;
+    unsigned long long stack_id;
+    unsigned long long parent_stack_id;
+    unsigned long long method_id;
+    unsigned long long transaction_id;
+    unsigned int thread_no;
+    unsigned int depth;
+    unsigned int kind;
+    unsigned int flags;
+};
+
+// Flags of a record
+static const unsigned int journal_unwound = 1;      // TraceEvent::unwound
+
+// The records start on the page after the header
+static const std::size_t journal_records_offset = 4096;
+
+// Copy of an event in a record (except for the stamp), and back
+void fill_record(const TraceEvent&, const unsigned int thread_no, JournalRecord&);
+void fill_event(const JournalRecord&, TraceEvent&);
+
+
+class EventJournal {
+    int fd;
+    int symbols_fd;
+    JournalHeader* header;
+    JournalRecord* records;
+    std::size_t mapped_size;
+
+  private:
+    void write_symbol(const std::string& line);
+
+    EventJournal(const EventJournal& _p) {}
+    EventJournal& operator=(const EventJournal& _p) {
+        return *this;
+    }
+
+  public:
+    EventJournal()
+     : fd(-1), symbols_fd(-1), header(0), records(0), mapped_size(0) {
+    }
+
+    ~EventJournal() {
+        close(false);
+    }
+
+    // Create (or truncate) the journal for `capacity` records
+    bool open(const std::string& path, const unsigned long long capacity);
+
+    inline bool ready() const {
+        return header != 0;
+    }
+
+    // Not thread-safe: called under the agent monitor, like the queue pushes
+    void thread(const unsigned int thread_no, const std::string& thread_name);
+    void method(const unsigned long long method_id, const std::string& class_name,
+                const std::string& method_name, const std::string& signature_name);
+    void append(const TraceEvent&, const unsigned int thread_no);
+
+    // Mark the journal as left by a crash; async-signal-safe
+    void seal();
+
+    // `clean` when everything was saved in the DB and the journal is not
+    // needed anymore
+    void close(bool clean);
+};
+
+#endif
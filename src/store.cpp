@@ -26,6 +26,8 @@
 #include <list>
 #include <map>
 #include <fstream>
+#include <cstdlib>
+#include <fnmatch.h>
 
 using namespace std;
 using boost::tuple;
@@ -42,13 +44,13 @@ bool TraceStore::processQueue() {
 
     while (running) {
         try {
-            TupleQueueElement item;
+            TraceEvent item;
             if (queue.try_pop(item)) {
 
                 #ifdef DEBUG_INLINE         
                     cout << "TraceStore::processQueue- Popped element form the queue, store it in the DB" << endl;
                 #endif
-                push(item);
+                process(item);
             }
 
         }
@@ -62,41 +64,79 @@ bool TraceStore::processQueue() {
 
     if (!queue.empty()) {
         while(!queue.empty()) {
-            TupleQueueElement item;
+            TraceEvent item;
             if (queue.try_pop(item)) {
-                push(item);
+                process(item);
             }
         }
     }
 
+    flush_aggregates();
     return true;
 }
 
 
 bool TraceStore::filter(const string& class_name) {
-    map<string, bool>::const_iterator filter_iter = filter_cache.find(class_name);
-    if (filter_iter != filter_cache.end())
-        return filter_iter->second;
+    bool* cached = filter_cache.find(class_name);
+    if (cached)
+        return *cached;
 
     for (list<string>::const_iterator iter=class_whitelist.begin(); iter!=class_whitelist.end(); ++iter) {
         if (class_name.find(*iter) != string::npos) {
-            filter_cache[class_name] = false;
+            filter_cache.insert(class_name, false);
             return false;
         }
     }   
 
     for (list<string>::const_iterator iter=class_blacklist.begin(); iter!=class_blacklist.end(); ++iter) {
         if (class_name.find(*iter) != string::npos) {
-            filter_cache[class_name] = true;
+            filter_cache.insert(class_name, true);
             return true;
         }
     }
 
-    filter_cache[class_name] = false;
+    filter_cache.insert(class_name, false);
     return false;
 }
 
 
+void TraceStore::forget_class(const string& class_name) {
+    filter_cache.erase(class_name);
+}
+
+
+// Half of the budget is for the store, the other half for the caches of the
+// agent callbacks (see set_cache_budget in the agent)
+void TraceStore::set_cache_budget(const size_t bytes) {
+    filter_cache.set_budget(bytes / 20);
+    thread_cache.set_budget(bytes / 20);
+    thread_group_cache.set_budget(bytes / 20);
+    class_cache.set_budget(bytes / 10);
+    method_cache.set_budget(bytes / 20);
+    signature_cache.set_budget(bytes / 20);
+    method_fqns.set_budget(bytes / 10);
+    fqn_classes.set_budget(bytes / 20);
+}
+
+
+void TraceStore::set_mode(const string& mode_name) {
+    if (mode_name == "cct")
+        mode = MODE_CCT;
+    else if (mode_name == "edges")
+        mode = MODE_EDGES;
+    else if (mode_name == "trace")
+        mode = MODE_TRACE;
+    else
+        cout << "TraceStore::set_mode- Unknown mode: " << mode_name << ", keeping the current one" << endl;
+}
+
+
+void TraceStore::set_fold_window(const string& window) {
+    int rows = atoi(window.c_str());
+    fold_window = rows > 0 ? rows : 4096;
+}
+
+
 void TraceStore::load_filter(const string& filters_filename) {
     ifstream in(filters_filename.c_str());
 
@@ -127,99 +167,417 @@ void TraceStore::load_filter(const string& filters_filename) {
 }
 
 
-void TraceStore::compute_serializable(const string& clazz, const string& generic) {
-    // search for Ljava/io/Serializable
-    map<string, bool>::const_iterator serial_iter = serializable.find(clazz);
-    if (serial_iter == serializable.end()) {
-        serializable[clazz] = generic.find("Ljava/io/Serializable") != string::npos;
+void TraceStore::load_thread_filter(const string& filters_filename) {
+    ifstream in(filters_filename.c_str());
+
+    cout << "Loading ... " << filters_filename << endl;
+    if (!in) {
+        cout << "Cannot open the thread filters at: " << filters_filename << endl;
+        return;
+    }
+    string line;
+    while (getline(in, line)) {
+        if (line.size() < 2)
+            continue;
+
+        if (line[0] == '+')
+            thread_includes.push_back(line.substr(1));
+        else if (line[0] == '-')
+            thread_excludes.push_back(line.substr(1));
     }
 }
 
 
-bool TraceStore::is_serializable(const string& clazz) const {
-    map<string, bool>::const_iterator serial_iter = serializable.find(clazz);
-    if (serial_iter != serializable.end())
-        return serial_iter->second;
+bool TraceStore::thread_selected(const string& thread_name) const {
+    for (list<string>::const_iterator iter=thread_excludes.begin(); iter!=thread_excludes.end(); ++iter) {
+        if (0 == fnmatch(iter->c_str(), thread_name.c_str(), 0))
+            return false;
+    }
+
+    if (thread_includes.empty())
+        return true;
+
+    for (list<string>::const_iterator iter=thread_includes.begin(); iter!=thread_includes.end(); ++iter) {
+        if (0 == fnmatch(iter->c_str(), thread_name.c_str(), 0))
+            return true;
+    }
     return false;
 }
 
-bool TraceStore::pop(const string& thread_name, const unsigned long long methodId) {
-    return true;
+
+void TraceStore::load_triggers(const string& triggers_filename) {
+    ifstream in(triggers_filename.c_str());
+
+    cout << "Loading ... " << triggers_filename << endl;
+    if (!in) {
+        cout << "Cannot open the triggers at: " << triggers_filename << endl;
+        return;
+    }
+    string line;
+    while (getline(in, line)) {
+        string::size_type dot = line.rfind('.');
+        if (dot == string::npos || dot == 0 || dot + 1 == line.size()) {
+            if (!line.empty())
+                cout << "TraceStore::load_triggers- Ignoring the trigger: " << line << endl;
+            continue;
+        }
+        triggers.push_back(make_pair(line.substr(0, dot), line.substr(dot + 1)));
+    }
 }
 
 
-bool TraceStore::push(const string& thread_name, const string& class_name, const string& method_name, const string& signature_name, const unsigned long long methodId, const unsigned long long parent_methodId) {
+bool TraceStore::trigger_class(const string& class_name) {
+    for (list<pair<string, string> >::const_iterator iter=triggers.begin(); iter!=triggers.end(); ++iter) {
+        if (class_name.find(iter->first) != string::npos)
+            return true;
+    }
+    return false;
+}
+
+
+bool TraceStore::trigger(const string& class_name, const string& method_name) {
+    for (list<pair<string, string> >::const_iterator iter=triggers.begin(); iter!=triggers.end(); ++iter) {
+        if (iter->second == method_name && class_name.find(iter->first) != string::npos)
+            return true;
+    }
+    return false;
+}
 
-    TupleQueueElement e(thread_name, class_name, method_name, signature_name, methodId, parent_methodId);
+
+bool TraceStore::push(const TraceEvent& e) {
     queue.push(e);
     return true;
 }
 
-bool TraceStore::push(const TupleQueueElement& item) {
-    unsigned int thread_id = 0, class_id = 0, method_id = 0, signature_id = 0, fqn_id = 0;
 
-    string thread_name = item.get<0>(), 
-           class_name = item.get<1>(), 
-           method_name = item.get<2>(), 
-           signature_name = item.get<3>();
+unsigned long long TraceStore::thread_key(const string& thread_name) {
+    return name_key(thread_cache, db::NAME_THREAD, thread_name);
+}
+
+
+// Id of a name in one of the dictionaries: the cache, or the DB when it was
+// evicted, or a new row
+unsigned long long TraceStore::name_key(KeyCache& cache, const db::NameKind kind, const string& name) {
+    unsigned long long* cached = cache.find(name);
+    if (cached)
+        return *cached;
+
+    unsigned long long name_id = database.find_name(kind, name);
+    if (!name_id) {
+        switch (kind) {
+            case db::NAME_THREAD:
+                name_id = database.thread(name);
+                break;
+            case db::NAME_CLASS:
+                name_id = database.clazz(name);
+                break;
+            case db::NAME_METHOD:
+                name_id = database.method(name);
+                break;
+            default:
+                name_id = database.signature(name);
+                break;
+        }
+    }
+    return cache.insert(name, name_id);
+}
+
+
+// The fqns are keyed by jmethodID: the row is created at the first call of the
+// method, and named when the symbolizer resolved it (see symbol)
+unsigned long long TraceStore::fqn_key(const unsigned long long jmethod_id) {
+    unsigned long long* cached = method_fqns.find(jmethod_id);
+    if (cached)
+        return *cached;
+
+    unsigned long long fqn_id = database.find_fqn(jmethod_id);
+    if (!fqn_id)
+        fqn_id = database.fqn(0, 0, 0, jmethod_id);
+    return method_fqns.insert(jmethod_id, fqn_id);
+}
+
+
+unsigned long long TraceStore::fqn_class(const unsigned long long fqn_id) {
+    unsigned long long* cached = fqn_classes.find(fqn_id);
+    if (cached)
+        return *cached;
+
+    // 0 until `symbol` names the fqn, which updates the cache
+    return fqn_classes.insert(fqn_id, database.fqn_class(fqn_id));
+}
+
+
+void TraceStore::symbol(const TraceEvent& item) {
+    unsigned long long fqn_id = fqn_key(item.method_id);
+
+    // Named already: the agent forgot its verdict and asked again
+    if (fqn_class(fqn_id))
+        return;
+
+    unsigned long long class_id = name_key(class_cache, db::NAME_CLASS, item.class_name);
+    unsigned long long method_id = name_key(method_cache, db::NAME_METHOD, item.method_name);
+    unsigned long long signature_id = name_key(signature_cache, db::NAME_SIGNATURE, item.signature_name);
+
+    database.fqn_names(fqn_id, class_id, method_id, signature_id);
+    fqn_classes.insert(fqn_id, class_id);
+
+    // The calls made before the method was named go to its class now
+    const CallSummary* calls = fqn_summaries.find(fqn_id);
+    if (calls)
+        class_summaries.merge(class_id, *calls);
+}
+
+
+const string& TraceStore::thread_group_key(const unsigned long long thread_id, const string& thread_name) {
+    string* cached = thread_group_cache.find(thread_id);
+    if (cached)
+        return *cached;
+
+    return thread_group_cache.insert(thread_id, thread_group(thread_name));
+}
+
+
+CallingContextTree* TraceStore::thread_cct(const unsigned int thread_no, const unsigned long long thread_id) {
+    map<unsigned int, CallingContextTree*>::const_iterator iter = cct_threads.find(thread_no);
+    if (iter != cct_threads.end())
+        return iter->second;
+
+    CallingContextTree* tree = new CallingContextTree(thread_id);
+    cct_threads[thread_no] = tree;
+    return tree;
+}
+
+
+SubtreeFolder* TraceStore::thread_folder(const unsigned int thread_no, const unsigned long long thread_id) {
+    map<unsigned int, SubtreeFolder*>::const_iterator iter = fold_threads.find(thread_no);
+    if (iter != fold_threads.end())
+        return iter->second;
+
+    SubtreeFolder* folder = new SubtreeFolder(thread_id, fold_window);
+    fold_threads[thread_no] = folder;
+    return folder;
+}
 
-    unsigned long long methodId = item.get<4>(), 
-                       parent_methodId = item.get<5>();
 
+void TraceStore::thread_end(const unsigned int thread_no) {
+    method_latencies.thread_end(thread_no);
+    call_graph.thread_end(thread_no);
+
+    map<unsigned int, CallingContextTree*>::iterator cct = cct_threads.find(thread_no);
+    map<unsigned int, SubtreeFolder*>::iterator folder = fold_threads.find(thread_no);
+    if (cct == cct_threads.end() && folder == fold_threads.end())
+        return;
 
-    KeyCache::const_iterator cache_iter = thread_cache.find(thread_name);
-    if (cache_iter == thread_cache.end()) {
-        unsigned int last_thread = database.thread(thread_name);
-        thread_cache[thread_name] = last_thread;
-        thread_id = last_thread;
+    database.begin();
+    if (cct != cct_threads.end()) {
+        cct->second->flush(database);
+        delete cct->second;
+        cct_threads.erase(cct);
     }
-    else
-        thread_id = cache_iter->second;
+    if (folder != fold_threads.end()) {
+        folder->second->flush(database);
+        delete folder->second;
+        fold_threads.erase(folder);
+    }
+    database.commit();
+}
+
+
+void TraceStore::exception(const unsigned long long thread_id, const TraceEvent& item) {
+    unsigned long long class_id = name_key(class_cache, db::NAME_CLASS, item.class_name);
+    unsigned long long throw_fqn_id = fqn_key(item.method_id);
+    unsigned long long catch_fqn_id = item.catch_method_id ? fqn_key(item.catch_method_id) : 0;
 
+    exception_summaries.hit(throw_fqn_id, item.location, class_id, catch_fqn_id != 0, item.depth);
 
-    cache_iter = class_cache.find(class_name);
-    if (cache_iter == class_cache.end()) {
-        unsigned int last_class = database.clazz(class_name);
-        class_cache[class_name] = last_class;
-        class_id = last_class;
+    // The rows of the calls only exist in MODE_TRACE; the unwound calls were
+    // pinned by their exit
+    if (mode == MODE_TRACE) {
+        if (fold_window) {
+            thread_folder(item.thread_no, thread_id)->pin(item.parent_trace_id);
+            thread_folder(item.thread_no, thread_id)->pin(item.trace_id);
+        }
+        database.exception(thread_id, class_id, throw_fqn_id, item.location, item.parent_trace_id,
+                           catch_fqn_id, item.catch_location, item.trace_id, item.depth, item.sequence, item.transaction_id);
     }
-    else
-        class_id = cache_iter->second;
+}
+
 
-    cache_iter = method_cache.find(method_name);
-    if (cache_iter == method_cache.end()) {
-        unsigned int last_method = database.method(method_name);
-        method_cache[method_name] = last_method;
-        method_id = last_method;
+void TraceStore::monitor(const unsigned long long thread_id, const TraceEvent& item) {
+    unsigned long long class_id = name_key(class_cache, db::NAME_CLASS, item.class_name);
+    unsigned long long site_fqn_id = item.method_id ? fqn_key(item.method_id) : 0;
+    bool wait = item.kind == TRACE_MONITOR_WAIT;
+
+    monitor_contention.hit(site_fqn_id, item.location, item.stack_id, class_id, wait, item.sequence);
+
+    if (mode == MODE_TRACE) {
+        if (fold_window)
+            thread_folder(item.thread_no, thread_id)->pin(item.trace_id);
+        database.monitor_event(thread_id, wait, class_id, site_fqn_id, item.location, item.trace_id,
+                               item.timestamp, item.sequence, item.transaction_id);
     }
-    else
-        method_id = cache_iter->second;
+}
+
 
+void TraceStore::allocation(const unsigned long long thread_id, const TraceEvent& item) {
+    unsigned long long class_id = name_key(class_cache, db::NAME_CLASS, item.class_name);
+    unsigned long long site_fqn_id = item.method_id ? fqn_key(item.method_id) : 0;
 
-    cache_iter = signature_cache.find(signature_name);
-    if (cache_iter == signature_cache.end()) {
-        unsigned int last_signature = database.signature(signature_name);
-        signature_cache[signature_name] = last_signature;
-        signature_id = last_signature;
+    allocation_summaries.hit(site_fqn_id, item.location, item.stack_id, class_id, item.size);
+
+    if (mode == MODE_TRACE) {
+        if (fold_window)
+            thread_folder(item.thread_no, thread_id)->pin(item.trace_id);
+        database.allocation(thread_id, class_id, item.size, site_fqn_id, item.location, item.stack_id,
+                            item.trace_id, item.timestamp, item.transaction_id);
     }
-    else
-        signature_id = cache_iter->second;
+}
+
 
-    TupleFQN tupleFQN(class_id, method_id, signature_id);
-    TupleKeyCache::const_iterator tuple_iter = fqn_cache.find(tupleFQN);
-    if (tuple_iter == fqn_cache.end()) {
-        unsigned int last_fqn = database.fqn(class_id, method_id, signature_id, (unsigned long long)methodId);
-        fqn_cache[tupleFQN] = last_fqn;
-        fqn_id = last_fqn;
+void TraceStore::heap_snapshot(const TraceEvent& item) {
+    unsigned long long instances = 0;
+    unsigned long long bytes = 0;
+    map<unsigned long long, pair<unsigned long long, unsigned long long> >::const_iterator iter;
+    for (iter=heap_classes.begin(); iter!=heap_classes.end(); ++iter) {
+        instances += iter->second.first;
+        bytes += iter->second.second;
     }
-    else
-        fqn_id = tuple_iter->second;
 
-    trace_id = database.trace(thread_id, fqn_id, (unsigned long long)parent_methodId);
+    database.begin();
+    unsigned long long snapshot_id = database.heap_snapshot(item.timestamp, item.class_name, item.sequence, heap_classes.size(), instances, bytes);
+    for (iter=heap_classes.begin(); iter!=heap_classes.end(); ++iter) {
+        database.heap_class(snapshot_id, iter->first, iter->second.first, iter->second.second);
+    }
+    database.commit();
+    heap_classes.clear();
+    heap_snapshot_id = snapshot_id;
+}
+
+
+void TraceStore::retention_path(const TraceEvent& item) {
+    unsigned long long class_id = name_key(class_cache, db::NAME_CLASS, item.class_name);
+
+    database.begin();
+    unsigned long long path_id = database.retention_path(heap_snapshot_id, class_id, item.method_name, item.sequence);
+    for (size_t i=0; i<retention_links.size(); i++) {
+        database.retention_link(path_id, retention_links[i].get<0>(), retention_links[i].get<1>(), retention_links[i].get<2>());
+    }
+    database.commit();
+    retention_links.clear();
+}
+
+
+bool TraceStore::process(const TraceEvent& item) {
+    if (item.kind == TRACE_DUMP) {
+        flush_aggregates();
+        database.checkpoint(item.finalize);
+        return true;
+    }
+
+    if (item.kind == TRACE_SYMBOL) {
+        symbol(item);
+        return true;
+    }
+
+    if (item.kind == TRACE_METRIC) {
+        agent_metrics[item.class_name] = item.sequence;
+        return true;
+    }
+
+    if (item.kind == TRACE_HEAP_CLASS) {
+        pair<unsigned long long, unsigned long long>& counts = heap_classes[name_key(class_cache, db::NAME_CLASS, item.class_name)];
+        counts.first += item.sequence;
+        counts.second += item.size;
+        return true;
+    }
+
+    if (item.kind == TRACE_HEAP_SNAPSHOT) {
+        heap_snapshot(item);
+        return true;
+    }
+
+    if (item.kind == TRACE_RETENTION_LINK) {
+        retention_links.push_back(boost::make_tuple(item.depth, name_key(class_cache, db::NAME_CLASS, item.class_name), item.sequence));
+        return true;
+    }
+
+    if (item.kind == TRACE_RETENTION_PATH) {
+        retention_path(item);
+        return true;
+    }
+
+    if (item.kind == TRACE_THREAD_END) {
+        thread_end(item.thread_no);
+        return true;
+    }
+
+    unsigned long long thread_id = thread_key(item.thread_name);
+
+    if (item.kind == TRACE_EXCEPTION) {
+        exception(thread_id, item);
+    }
+    else if (item.kind == TRACE_MONITOR_ENTER || item.kind == TRACE_MONITOR_WAIT) {
+        monitor(thread_id, item);
+    }
+    else if (item.kind == TRACE_ALLOCATION) {
+        allocation(thread_id, item);
+    }
+    else if (item.kind == TRACE_EXIT) {
+        method_latencies.exit(item.thread_no, item.trace_id, item.timestamp);
+
+        switch (mode) {
+            case MODE_CCT:
+                thread_cct(item.thread_no, thread_id)->exit(item.timestamp);
+                break;
+            case MODE_EDGES:
+                call_graph.exit(item.thread_no, item.timestamp);
+                break;
+            default:
+                if (fold_window)
+                    thread_folder(item.thread_no, thread_id)->exit(database, item.sequence, item.unwound);
+                else
+                    database.trace_exit(item.trace_id, item.sequence);
+                break;
+        }
+    }
+    else {
+        unsigned long long fqn_id = fqn_key(item.method_id);
+
+        fqn_summaries.hit(fqn_id, item.sequence);
+        thread_summaries.hit(thread_id, item.sequence);
+
+        unsigned long long class_id = fqn_class(fqn_id);
+        if (class_id)
+            class_summaries.hit(class_id, item.sequence);
+
+        if (item.new_stack)
+            database.stack(item.stack_id, item.parent_stack_id, fqn_id, item.depth);
+
+        method_latencies.enter(item.thread_no, thread_group_key(thread_id, item.thread_name), fqn_id, item.trace_id, item.timestamp);
+
+        switch (mode) {
+            case MODE_CCT:
+                thread_cct(item.thread_no, thread_id)->enter(fqn_id, item.timestamp, cct_node_counter);
+                break;
+            case MODE_EDGES:
+                call_graph.enter(item.thread_no, thread_group_key(thread_id, item.thread_name), fqn_id, item.timestamp);
+                break;
+            default:
+                if (fold_window) {
+                    TraceRow row = {item.trace_id, item.parent_trace_id, item.sequence, 0, item.stack_id, 1, fqn_id, item.depth, item.transaction_id};
+                    thread_folder(item.thread_no, thread_id)->enter(row);
+                    trace_id = item.trace_id;
+                }
+                else
+                    trace_id = database.trace(item.trace_id, thread_id, fqn_id, item.parent_trace_id, item.depth, item.sequence, item.stack_id, item.transaction_id);
+                break;
+        }
+    }
 
 #ifdef DATABASE_PERIODIC_DUMP
-    if (0 == (trace_id % 1000000)) {
-        database.save();
+    if (0 == (++events_processed % 1000000)) {
+        flush_aggregates();
+        database.checkpoint();
     }
 #endif
 
@@ -227,9 +585,54 @@ bool TraceStore::push(const TupleQueueElement& item) {
 }
 
 
+void TraceStore::flush_aggregates() {
+    if (cct_threads.empty() && call_graph.empty() && fold_threads.empty() && fqn_summaries.empty() && method_latencies.empty()
+        && exception_summaries.empty() && monitor_contention.empty() && allocation_summaries.empty())
+        return;
+
+    database.begin();
+    for (map<unsigned int, CallingContextTree*>::const_iterator iter=cct_threads.begin(); iter!=cct_threads.end(); ++iter) {
+        iter->second->flush(database);
+    }
+    for (map<unsigned int, SubtreeFolder*>::const_iterator iter=fold_threads.begin(); iter!=fold_threads.end(); ++iter) {
+        iter->second->flush(database);
+    }
+    call_graph.flush(database);
+    fqn_summaries.flush(database, db::SUMMARY_FQN);
+    thread_summaries.flush(database, db::SUMMARY_THREAD);
+    class_summaries.flush(database, db::SUMMARY_CLASS);
+    method_latencies.flush(database);
+    exception_summaries.flush(database);
+    monitor_contention.flush(database);
+    allocation_summaries.flush(database);
+
+    AgentMetrics metrics(agent_metrics);
+    thread_cache.report("store.threads", metrics);
+    thread_group_cache.report("store.thread_groups", metrics);
+    class_cache.report("store.classes", metrics);
+    method_cache.report("store.methods", metrics);
+    signature_cache.report("store.signatures", metrics);
+    method_fqns.report("store.method_fqns", metrics);
+    fqn_classes.report("store.fqn_classes", metrics);
+    for (AgentMetrics::const_iterator iter=metrics.begin(); iter!=metrics.end(); ++iter) {
+        database.metric(iter->first, iter->second);
+    }
+    database.commit();
+}
+
+
 // Hacky...
-void TraceStore::dump() {
-    database.save();
+void TraceStore::dump(bool finalize) {
+    if (running) {
+        TraceEvent e;
+        e.kind = TRACE_DUMP;
+        e.finalize = finalize;
+        queue.push(e);
+        return;
+    }
+
+    flush_aggregates();
+    database.save(finalize);
 }
 
 
@@ -40,12 +40,116 @@
 #endif
 
 #include "workqueue.h"
+#include "aggregate.h"
+#include "cache.h"
+
+typedef boost::tuple<unsigned long long, unsigned long long, unsigned long long> TupleFQN;
+typedef ClockCache<std::string, unsigned long long> KeyCache;
+typedef ClockCache<unsigned long long, unsigned long long> IdCache;
+
+
+enum TraceEventKind {
+    TRACE_ENTRY,
+    TRACE_EXIT,
+    TRACE_DUMP,
+    TRACE_SYMBOL,
+    TRACE_METRIC,
+    TRACE_EXCEPTION,
+    TRACE_MONITOR_ENTER,
+    TRACE_MONITOR_WAIT,
+    TRACE_ALLOCATION,
+    TRACE_HEAP_CLASS,
+    TRACE_HEAP_SNAPSHOT,
+    TRACE_RETENTION_LINK,
+    TRACE_RETENTION_PATH,
+    TRACE_THREAD_END
+};
 
-typedef boost::tuple<unsigned int, unsigned int, unsigned int> TupleFQN;
-typedef std::map<std::string, unsigned int> KeyCache;
-typedef std::map<TupleFQN, unsigned int> TupleKeyCache;
+// What the worker does with the events
+enum RecordMode {
+    MODE_TRACE,     // one row per call in `traces`
+    MODE_CCT,       // per-thread calling context tree in `cct_nodes`
+    MODE_EDGES      // caller -> callee counts in `edges`
+};
 
-typedef boost::tuple<std::string, std::string, std::string, std::string, unsigned long long, unsigned long long> TupleQueueElement;
+// Element of the queue between the JVMTI callbacks and the worker. The agent
+// assigns the row ids and the sequence numbers, so that the call tree is known
+// before anything hits the DB:
+//  - `trace_id` is the row of the call, `parent_trace_id` the row of its caller
+//  - `sequence` is the enter (TRACE_ENTRY) or exit (TRACE_EXIT) sequence number
+//  - `timestamp` is the JVMTI time (ns) of the entry/exit
+//  - `thread_no` is the number of the thread in the agent: the per-thread
+//    state of the worker is keyed by it, as threads may share a name (the
+//    name only gives the thread of the rows)
+//  - `transaction_id` is the activation of the trigger the call is under, 0
+//    when no triggers are configured
+//  - `stack_id` is the interned call path of the call (see get_stack_id in the
+//    agent); `new_stack` is set the first time the path is seen, along with
+//    the path of the caller in `parent_stack_id`
+//  - `unwound` is set on the TRACE_EXIT of a call unwound by a recorded
+//    exception: the exception event refers to the call, or to one of its
+//    callees
+// A TRACE_DUMP event asks the worker to save the DB once everything queued
+// before it has been processed.
+// The entry events only carry the jmethodID: the names of the method come
+// later, in a TRACE_SYMBOL event sent by the symbolizer of the agent.
+// A TRACE_METRIC event carries a self-metric of the agent callbacks: its name
+// in `class_name` and its value in `sequence`.
+// A TRACE_EXCEPTION event is a thrown exception, sent once its catch is known:
+// its class in `class_name`, the throw site in `method_id`/`location` and the
+// catch site in `catch_method_id`/`catch_location` (0 when no Java code caught
+// it), the closest recorded calls of the throw and of the catch in
+// `parent_trace_id`/`trace_id`, the frames it unwound in `depth`, and the
+// sequence number of the throw.
+// A TRACE_MONITOR_ENTER (contended enter) or TRACE_MONITOR_WAIT event is a
+// thread that was blocked on a monitor: the monitor class in `class_name`,
+// the site in `method_id`/`location`, the call path and the closest recorded
+// call in `stack_id`/`trace_id`, when it blocked in `timestamp` and for how
+// long (ns) in `sequence`.
+// A TRACE_ALLOCATION event is an allocation sample: the allocated class in
+// `class_name`, its size in `size`, and the site, call path and closest
+// recorded call as for the monitors.
+// A heap census is a TRACE_HEAP_CLASS event per class, with its instances in
+// `sequence` and their shallow size in `size`, then a TRACE_HEAP_SNAPSHOT
+// event with the reason of the census in `class_name`, when it started in
+// `timestamp` and how long it took (ns) in `sequence`.
+// A retention path of a leak suspect of the last census is a TRACE_RETENTION_LINK
+// event per link from the root, with its class in `class_name`, its position
+// in `depth` and its longest run in `sequence`, then a TRACE_RETENTION_PATH
+// event with the suspect class in `class_name`, the root in `method_name` and
+// the number of samples in `sequence`.
+// A TRACE_THREAD_END event is the last event of the thread `thread_no`: the
+// worker writes and drops what it keeps for the thread.
+struct TraceEvent {
+    TraceEventKind kind;
+    std::string thread_name;
+    std::string class_name;
+    std::string method_name;
+    std::string signature_name;
+    unsigned int thread_no;
+    unsigned long long method_id;
+    unsigned long long trace_id;
+    unsigned long long parent_trace_id;
+    unsigned int depth;
+    unsigned long long sequence;
+    unsigned long long timestamp;
+    unsigned long long stack_id;
+    unsigned long long parent_stack_id;
+    unsigned long long transaction_id;
+    long long location;
+    unsigned long long catch_method_id;
+    long long catch_location;
+    unsigned long long size;
+    bool new_stack;
+    bool unwound;
+    bool finalize;
+
+    TraceEvent() 
+     : kind(TRACE_ENTRY), thread_no(0), method_id(0), trace_id(0), parent_trace_id(0), depth(0), sequence(0), timestamp(0),
+       stack_id(0), parent_stack_id(0), transaction_id(0), location(0), catch_method_id(0), catch_location(0),
+       size(0), new_stack(false), unwound(false), finalize(false) {
+    }
+};
 
 
 static boost::condition element_available;
@@ -57,7 +161,7 @@ static boost::mutex worker_mutex;
 //       (call stacks) in the DB
 struct TraceStore {
     bool running;
-    WorkQueue<TupleQueueElement> queue;
+    WorkQueue<TraceEvent> queue;
     boost::thread thread_worker;
 
 
@@ -66,24 +170,85 @@ struct TraceStore {
 #endif
 
     bool start_recording;
+    RecordMode mode;
     unsigned long long trace_id;
+    unsigned long long events_processed;
 
+    // Producer side counters (only updated under the agent monitor)
+    unsigned long long trace_counter;
+    unsigned long long sequence_counter;
+    unsigned long long stack_counter;
+    unsigned long long transaction_counter;
+
+    // Bounded (see set_cache_budget), what is evicted is looked up in the DB
     KeyCache thread_cache;
     KeyCache class_cache;
     KeyCache method_cache;
     KeyCache signature_cache;
-    TupleKeyCache fqn_cache;
 
-    std::map<std::string, bool> serializable;
-    std::map<std::string, bool> filter_cache;
+    // jmethodID -> fqn, and fqn -> class once the method is named
+    IdCache method_fqns;
+    IdCache fqn_classes;
+
+    // Used by the agent callbacks (under the agent monitor), not the worker
+    ClockCache<std::string, bool> filter_cache;
     std::list<std::string> class_whitelist;
     std::list<std::string> class_blacklist;
 
+    // Thread name patterns (fnmatch), see load_thread_filter
+    std::list<std::string> thread_includes;
+    std::list<std::string> thread_excludes;
+
+    // Trigger methods: (class, method name), see load_triggers
+    std::list<std::pair<std::string, std::string> > triggers;
+
     // Stack of FQN per thread
-    std::map<unsigned int, TupleFQN> current_fqn;
+    std::map<unsigned long long, TupleFQN> current_fqn;
+
+    // Aggregates (MODE_CCT, MODE_EDGES), only touched by the worker. The
+    // per-thread ones are keyed by thread_no
+    std::map<unsigned int, CallingContextTree*> cct_threads;
+    unsigned long long cct_node_counter;
+    CallGraph call_graph;
+    ClockCache<unsigned long long, std::string> thread_group_cache;
+
+    // Folding of the repeated subtrees (MODE_TRACE), off when the window is 0
+    std::size_t fold_window;
+    std::map<unsigned int, SubtreeFolder*> fold_threads;
+
+    // Calls per fqn, thread and class (all modes)
+    CallSummaries fqn_summaries;
+    CallSummaries thread_summaries;
+    CallSummaries class_summaries;
+
+    // Call durations per fqn and thread group (all modes)
+    MethodLatencies method_latencies;
+
+    // Exceptions per throw site and class (all modes)
+    ExceptionSummaries exception_summaries;
+
+    // Blocked time on the monitors (all modes)
+    MonitorContention monitor_contention;
+
+    // Allocation samples (all modes)
+    AllocationSummaries allocation_summaries;
+
+    // Classes of the heap census being received (TRACE_HEAP_CLASS): class ->
+    // (instances, bytes), the classes of the same name add up
+    std::map<unsigned long long, std::pair<unsigned long long, unsigned long long> > heap_classes;
+    unsigned long long heap_snapshot_id;
+
+    // Links of the retention path being received (TRACE_RETENTION_LINK):
+    // (depth, class, repeat count)
+    std::vector<boost::tuple<unsigned int, unsigned long long, unsigned long long> > retention_links;
+
+    // Self-metrics sent by the agent callbacks (TRACE_METRIC)
+    AgentMetrics agent_metrics;
 
     TraceStore() 
-     : running(true), start_recording(false) {
+     : running(true), start_recording(false), mode(MODE_TRACE), trace_id(0), events_processed(0),
+       trace_counter(0), sequence_counter(0), stack_counter(0), transaction_counter(0), cct_node_counter(0), fold_window(0),
+       heap_snapshot_id(0) {
     }
 
 
@@ -92,7 +257,14 @@ struct TraceStore {
         std::cout << "TraceStore::~TraceStore- Wait for worker thread to finish its job" << std::endl;
 #endif
         thread_worker.join();
-        dump();
+        dump(true);
+
+        for (std::map<unsigned int, CallingContextTree*>::iterator iter=cct_threads.begin(); iter!=cct_threads.end(); ++iter) {
+            delete iter->second;
+        }
+        for (std::map<unsigned int, SubtreeFolder*>::iterator iter=fold_threads.begin(); iter!=fold_threads.end(); ++iter) {
+            delete iter->second;
+        }
     }
 
     void wait_threads() {
@@ -105,30 +277,98 @@ struct TraceStore {
     bool filter(const std::string&);
     void load_filter(const std::string&);
 
-    void compute_serializable(const std::string&, const std::string&);
-    bool is_serializable(const std::string&) const;
+    // Only deliver the method events to some threads: `+pattern` includes the
+    // threads whose name matches, `-pattern` excludes them (e.g. +http-nio-*).
+    // With includes, the other threads are excluded.
+    void load_thread_filter(const std::string&);
+
+    bool has_thread_filter() const {
+        return !thread_includes.empty() || !thread_excludes.empty();
+    }
+
+    bool thread_selected(const std::string& thread_name) const;
+
+    // Only record the calls made under a trigger method, one line per trigger
+    // as `<class>.<method>` (e.g. javax/servlet/http/HttpServlet.service); the
+    // class is matched like the filters
+    void load_triggers(const std::string&);
+
+    bool has_triggers() const {
+        return !triggers.empty();
+    }
+
+    // Could the class declare a trigger? Is the method one?
+    bool trigger_class(const std::string& class_name);
+    bool trigger(const std::string& class_name, const std::string& method_name);
+
+    // The class was unloaded: drop its filter verdict
+    void forget_class(const std::string& class_name);
+
+    // Split the memory budget of the store between its caches
+    void set_cache_budget(const std::size_t bytes);
+
+    void set_mode(const std::string&);
+    void set_fold_window(const std::string&);
 
     // Queue processor (main thread function)
     bool processQueue();
 
-    // Wrapper for an element of the queue
-    bool push(const TupleQueueElement&);
+    // Worker side: store an element of the queue
+    bool process(const TraceEvent&);
 
     // Store trace
-    bool push(const std::string& thread_name, const std::string& class_name, 
-              const std::string& method_name, const std::string& signature_name,
-              const unsigned long long methodId, const unsigned long long parent_methodId);
+    bool push(const TraceEvent&);
+
+    // Get the DB ids of a thread, a name and of the fqn of a method
+    unsigned long long thread_key(const std::string& thread_name);
+    unsigned long long name_key(KeyCache&, const db::NameKind, const std::string& name);
+    unsigned long long fqn_key(const unsigned long long jmethod_id);
+
+    // Class of an fqn, 0 until the method is named
+    unsigned long long fqn_class(const unsigned long long fqn_id);
+
+    // Name the fqn of a TRACE_SYMBOL event
+    void symbol(const TraceEvent&);
+
+    // Store a TRACE_EXCEPTION event
+    void exception(const unsigned long long thread_id, const TraceEvent&);
+
+    // Store a TRACE_MONITOR_ENTER/WAIT event
+    void monitor(const unsigned long long thread_id, const TraceEvent&);
+
+    // Store a TRACE_ALLOCATION event
+    void allocation(const unsigned long long thread_id, const TraceEvent&);
+
+    // Store the heap census closed by a TRACE_HEAP_SNAPSHOT event
+    void heap_snapshot(const TraceEvent&);
+
+    // Store the retention path closed by a TRACE_RETENTION_PATH event
+    void retention_path(const TraceEvent&);
+    const std::string& thread_group_key(const unsigned long long thread_id, const std::string& thread_name);
+
+    // State of the thread `thread_no`, whose rows go to `thread_id`
+    CallingContextTree* thread_cct(const unsigned int thread_no, const unsigned long long thread_id);
+    SubtreeFolder* thread_folder(const unsigned int thread_no, const unsigned long long thread_id);
+
+    // Write and drop the state of an ended thread (TRACE_THREAD_END)
+    void thread_end(const unsigned int thread_no);
 
-    bool pop(const std::string& thread_name, const unsigned long long methodId);
+    // Write the in-memory aggregates to the DB (worker side)
+    void flush_aggregates();
 
 
     void set_database(const std::string& db_name) {
         database.update_database_path(db_name);
     }
 
-    void dump();
+    // Save the in-memory DB; `finalize` is used for the last dump of a
+    // recording session (builds the indexes). While the worker runs, the dump
+    // is queued behind the pending events and the worker hands it over to a
+    // background checkpoint, so neither the callers nor the worker wait for
+    // the copy.
+    void dump(bool finalize=false);
 
-    unsigned int queue_size() const {
+    std::size_t queue_size() const {
         return queue.size();
     }
 
@@ -0,0 +1,176 @@
+/*
+  Java JVMTI Trace Extraction
+  by Romain Gaucher <r@rgaucher.info> - http://rgaucher.info
+
+  Copyright (c) 2011-2012 Romain Gaucher <r@rgaucher.info>
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#include <iostream>
+
+#include "symbolizer.h"
+
+using namespace std;
+
+
+void get_classname(jvmtiEnv *jvmti, jclass declaring_class, string& clazz, string& generic) {
+    char *class_signature = 0, *class_generic = 0;
+
+    // Get the Class information
+    jvmti->GetClassSignature(declaring_class, &class_signature, &class_generic);
+    
+    if (class_signature) {
+        clazz.assign(class_signature);
+        jvmti->Deallocate(reinterpret_cast<unsigned char*>(class_signature));
+    }
+    if (class_generic) {
+        generic.assign(class_generic);
+        jvmti->Deallocate(reinterpret_cast<unsigned char*>(class_generic));
+    }
+}
+
+
+void get_method(jvmtiEnv *jvmti, jmethodID methodId, string& method, string& sig) {
+    char *method_name = 0, *method_signature = 0, *method_generic = 0;
+
+    // Get the method
+    jvmti->GetMethodName(methodId, &method_name, &method_signature, &method_generic);
+
+    if (method_name) {
+        method.assign(method_name);
+        jvmti->Deallocate(reinterpret_cast<unsigned char*>(method_name));
+    }
+    if (method_signature) {
+        sig.assign(method_signature);
+        jvmti->Deallocate(reinterpret_cast<unsigned char*>(method_signature));
+    }
+    if (method_generic) {
+        jvmti->Deallocate(reinterpret_cast<unsigned char*>(method_generic));
+    }
+}
+
+
+bool run_agent_thread(jvmtiEnv* jvmti, JNIEnv* jni, const char* name, jvmtiStartFunction proc, void* arg) {
+    // RunAgentThread needs a java.lang.Thread to run on
+    jclass thread_class = jni->FindClass("java/lang/Thread");
+    if (!thread_class)
+        return false;
+    jmethodID thread_init = jni->GetMethodID(thread_class, "<init>", "(Ljava/lang/String;)V");
+    if (!thread_init)
+        return false;
+    jthread thread = jni->NewObject(thread_class, thread_init, jni->NewStringUTF(name));
+    if (!thread)
+        return false;
+
+    return JVMTI_ERROR_NONE == jvmti->RunAgentThread(thread, proc, arg, JVMTI_THREAD_NORM_PRIORITY);
+}
+
+
+bool Symbolizer::start(jvmtiEnv* _jvmti, JNIEnv* jni, SymbolHandler _handler) {
+    jvmti = _jvmti;
+    handler = _handler;
+
+    if (JVMTI_ERROR_NONE != jvmti->CreateRawMonitor("symbolizer", &lock))
+        return false;
+
+    running = true;
+    if (!run_agent_thread(jvmti, jni, "Trace Symbolizer", &Symbolizer::run, this)) {
+        cout << "Symbolizer::start- Cannot start the thread, the names are resolved by the application threads" << endl;
+        running = false;
+        return false;
+    }
+    return true;
+}
+
+
+bool Symbolizer::request(JNIEnv* jni, jmethodID method_id, jclass declaring_class) {
+    if (!lock)
+        return false;
+
+    jvmti->RawMonitorEnter(lock);
+    if (!running) {
+        jvmti->RawMonitorExit(lock);
+        return false;
+    }
+
+    PendingSymbol symbol;
+    symbol.method_id = method_id;
+    symbol.declaring_class = static_cast<jclass>(jni->NewGlobalRef(declaring_class));
+    pending.push_back(symbol);
+
+    jvmti->RawMonitorNotify(lock);
+    jvmti->RawMonitorExit(lock);
+    return true;
+}
+
+
+void Symbolizer::stop() {
+    if (!lock)
+        return;
+
+    jvmti->RawMonitorEnter(lock);
+    if (running) {
+        running = false;
+        jvmti->RawMonitorNotifyAll(lock);
+        while (!finished)
+            jvmti->RawMonitorWait(lock, 0);
+    }
+    jvmti->RawMonitorExit(lock);
+}
+
+
+void JNICALL Symbolizer::run(jvmtiEnv* jvmti, JNIEnv* jni, void* arg) {
+    Symbolizer* symbolizer = static_cast<Symbolizer*>(arg);
+    vector<PendingSymbol> batch;
+
+    jvmti->RawMonitorEnter(symbolizer->lock);
+    while (true) {
+        while (symbolizer->pending.empty() && symbolizer->running)
+            jvmti->RawMonitorWait(symbolizer->lock, 0);
+
+        // Stopped, and nothing left
+        if (symbolizer->pending.empty())
+            break;
+
+        batch.swap(symbolizer->pending);
+        jvmti->RawMonitorExit(symbolizer->lock);
+
+        symbolizer->resolve(jni, batch);
+        batch.clear();
+
+        jvmti->RawMonitorEnter(symbolizer->lock);
+    }
+    symbolizer->finished = true;
+    jvmti->RawMonitorNotifyAll(symbolizer->lock);
+    jvmti->RawMonitorExit(symbolizer->lock);
+}
+
+
+void Symbolizer::resolve(JNIEnv* jni, vector<PendingSymbol>& batch) {
+    vector<MethodSymbol> symbols(batch.size());
+    string generic;
+
+    for (size_t i=0; i<batch.size(); i++) {
+        MethodSymbol& symbol = symbols[i];
+        symbol.method_id = reinterpret_cast<unsigned long long>(batch[i].method_id);
+        get_classname(jvmti, batch[i].declaring_class, symbol.class_name, generic);
+        get_method(jvmti, batch[i].method_id, symbol.method_name, symbol.signature_name);
+
+        jni->DeleteGlobalRef(batch[i].declaring_class);
+    }
+
+#ifdef DEBUG_INLINE
+    cout << "Symbolizer::resolve- Resolved " << symbols.size() << " methods" << endl;
+#endif
+    handler(symbols);
+}
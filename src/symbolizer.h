@@ -0,0 +1,94 @@
+/*
+  Java JVMTI Trace Extraction
+  by Romain Gaucher <r@rgaucher.info> - http://rgaucher.info
+
+  Copyright (c) 2011-2012 Romain Gaucher <r@rgaucher.info>
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+#ifndef __SYMBOLIZER_H
+#define __SYMBOLIZER_H
+
+#include <string>
+#include <vector>
+
+#include <jvmti.h>
+
+#include "config.h"
+
+
+// Names of a method, as sent to the worker in a TRACE_SYMBOL event
+struct MethodSymbol {
+    unsigned long long method_id;
+    std::string class_name;
+    std::string method_name;
+    std::string signature_name;
+};
+
+typedef void (*SymbolHandler)(const std::vector<MethodSymbol>&);
+
+
+// Resolve the names of the recorded methods on an agent thread, so that the
+// application threads never pay for GetMethodName and the string copies. The
+// requests queued while a batch is resolved make the next batch.
+class Symbolizer {
+    // Method waiting for its names; `declaring_class` is a global reference
+    // that keeps the class, hence the jmethodID, alive until then
+    struct PendingSymbol {
+        jmethodID method_id;
+        jclass declaring_class;
+    };
+
+    jvmtiEnv* jvmti;
+    jrawMonitorID lock;
+    SymbolHandler handler;
+    std::vector<PendingSymbol> pending;
+
+    bool running;       // accepting requests
+    bool finished;      // the thread is done
+
+  private:
+    static void JNICALL run(jvmtiEnv*, JNIEnv*, void*);
+    void resolve(JNIEnv*, std::vector<PendingSymbol>&);
+
+    Symbolizer(const Symbolizer& _p) {}
+    Symbolizer& operator=(const Symbolizer& _p) {
+        return *this;
+    }
+
+  public:
+    Symbolizer()
+     : jvmti(0), lock(0), handler(0), running(false), finished(false) {
+    }
+
+    // Start the agent thread (live phase only, e.g. from VMInit); `handler`
+    // gets the resolved batches on that thread
+    bool start(jvmtiEnv*, JNIEnv*, SymbolHandler);
+
+    // Queue a method; false when the symbolizer does not run, the caller
+    // resolves the names by itself then
+    bool request(JNIEnv*, jmethodID, jclass declaring_class);
+
+    // Resolve what is still queued and stop the thread
+    void stop();
+};
+
+
+// Start `proc` on a new agent thread (live phase only)
+bool run_agent_thread(jvmtiEnv*, JNIEnv*, const char* name, jvmtiStartFunction proc, void* arg);
+
+// Signature of a class and names of a method (JVMTI lookups)
+void get_classname(jvmtiEnv*, jclass, std::string& clazz, std::string& generic);
+void get_method(jvmtiEnv*, jmethodID, std::string& method, std::string& sig);
+
+#endif
@@ -77,7 +77,8 @@ struct WorkQueue {
         msg.pop();
     }
 
-    unsigned int size() const {
+    std::size_t size() const {
+        boost::mutex::scoped_lock lock(mtx);
         return msg.size();
     }
 
@@ -17,7 +17,7 @@
   limitations under the License.
 """
 import sys, sqlite3
-import os, re
+import os, re, struct, mmap, math
 
 __isiterable = lambda x: isinstance(x, basestring) or getattr(x, '__iter__', False)
 __normalize_argmt = lambda x: ''.join(x.lower().split())
@@ -26,6 +26,515 @@ __normalize_path = lambda x: os.path.abspath(x)
 
 WINDOW_TRACE = 20
 
+# Same indexes as `db_finalize` in src/database.h, for DBs dumped without them
+FINALIZE_QUERIES = (
+	"CREATE INDEX IF NOT EXISTS traces_thread_id ON traces (thread_id, id)",
+	"CREATE INDEX IF NOT EXISTS traces_fqn_id ON traces (fqn_id)",
+	"CREATE INDEX IF NOT EXISTS traces_transaction_id ON traces (transaction_id)",
+	"CREATE INDEX IF NOT EXISTS fqns_class_method ON fqns (class_id, method_id)",
+	"CREATE INDEX IF NOT EXISTS edges_callee ON edges (callee_fqn_id)",
+	"CREATE INDEX IF NOT EXISTS exceptions_throw ON exceptions (throw_fqn_id, class_id)",
+	"ANALYZE",
+)
+
+# Layout of the crash journal, see src/journal.h
+JOURNAL_MAGIC = 'JTRACEJ2'
+JOURNAL_HEADER = struct.Struct('=8s4Q')
+JOURNAL_RECORD = struct.Struct('=9Q4I')
+JOURNAL_RECORDS_OFFSET = 4096
+JOURNAL_STATES = ('open (the JVM was killed?)', 'clean', 'crashed')
+JOURNAL_ENTRY, JOURNAL_EXIT = 0, 1
+
+# Same tables (and views) as `db_schema` in src/database.h
+RECOVER_SCHEMA = (
+	"CREATE TABLE traces (id INTEGER PRIMARY KEY, thread_id INTEGER, fqn_id INTEGER, parent_trace_id INTEGER, depth INTEGER, enter_seq INTEGER, exit_seq INTEGER, stack_id INTEGER, repeat_count INTEGER, transaction_id INTEGER)",
+	"CREATE TABLE stacks (id INTEGER PRIMARY KEY, parent_stack_id INTEGER, fqn_id INTEGER, depth INTEGER)",
+	"CREATE TABLE threads (id INTEGER PRIMARY KEY, thread_name TEXT)",
+	"CREATE TABLE fqns (id INTEGER PRIMARY KEY, class_id INTEGER, method_id INTEGER, signature_id INTEGER, jmethod_id INTEGER)",
+	"CREATE TABLE classes (id INTEGER PRIMARY KEY, class_name TEXT)",
+	"CREATE TABLE methods (id INTEGER PRIMARY KEY, method_name TEXT)",
+	"CREATE TABLE signatures (id INTEGER PRIMARY KEY, signature_name TEXT)",
+	"CREATE TABLE cct_nodes (id INTEGER PRIMARY KEY, thread_id INTEGER, parent_id INTEGER, fqn_id INTEGER, depth INTEGER, calls INTEGER, total_time INTEGER, self_time INTEGER)",
+	"CREATE TABLE edges (id INTEGER PRIMARY KEY, caller_fqn_id INTEGER, callee_fqn_id INTEGER, thread_group TEXT, calls INTEGER, total_time INTEGER)",
+	"CREATE TABLE fqn_summary (fqn_id INTEGER PRIMARY KEY, calls INTEGER, first_seq INTEGER, last_seq INTEGER)",
+	"CREATE TABLE thread_summary (thread_id INTEGER PRIMARY KEY, calls INTEGER, first_seq INTEGER, last_seq INTEGER)",
+	"CREATE TABLE class_summary (class_id INTEGER PRIMARY KEY, calls INTEGER, first_seq INTEGER, last_seq INTEGER)",
+	"CREATE TABLE agent_metrics (name TEXT PRIMARY KEY, value INTEGER)",
+	"CREATE TABLE latency_histograms (fqn_id INTEGER, thread_group TEXT, bucket INTEGER, low INTEGER, high INTEGER, calls INTEGER, PRIMARY KEY (fqn_id, thread_group, bucket))",
+	"CREATE TABLE exceptions (id INTEGER PRIMARY KEY, thread_id INTEGER, class_id INTEGER, throw_fqn_id INTEGER, throw_location INTEGER, throw_trace_id INTEGER, catch_fqn_id INTEGER, catch_location INTEGER, catch_trace_id INTEGER, frames_unwound INTEGER, sequence INTEGER, transaction_id INTEGER)",
+	"CREATE TABLE exception_summary (throw_fqn_id INTEGER, throw_location INTEGER, class_id INTEGER, throws INTEGER, caught INTEGER, frames_unwound INTEGER, PRIMARY KEY (throw_fqn_id, throw_location, class_id))",
+	"CREATE TABLE monitor_events (id INTEGER PRIMARY KEY, thread_id INTEGER, wait INTEGER, class_id INTEGER, site_fqn_id INTEGER, site_location INTEGER, trace_id INTEGER, start_time INTEGER, blocked_time INTEGER, transaction_id INTEGER)",
+	"CREATE TABLE monitor_sites (site_fqn_id INTEGER, site_location INTEGER, class_id INTEGER, wait INTEGER, events INTEGER, blocked_time INTEGER, max_blocked_time INTEGER, PRIMARY KEY (site_fqn_id, site_location, class_id, wait))",
+	"CREATE TABLE monitor_stacks (stack_id INTEGER, class_id INTEGER, wait INTEGER, events INTEGER, blocked_time INTEGER, max_blocked_time INTEGER, PRIMARY KEY (stack_id, class_id, wait))",
+	"CREATE TABLE allocations (id INTEGER PRIMARY KEY, thread_id INTEGER, class_id INTEGER, size INTEGER, site_fqn_id INTEGER, site_location INTEGER, stack_id INTEGER, trace_id INTEGER, time INTEGER, transaction_id INTEGER)",
+	"CREATE TABLE allocation_sites (site_fqn_id INTEGER, site_location INTEGER, class_id INTEGER, samples INTEGER, bytes INTEGER, PRIMARY KEY (site_fqn_id, site_location, class_id))",
+	"CREATE TABLE allocation_stacks (stack_id INTEGER, class_id INTEGER, samples INTEGER, bytes INTEGER, PRIMARY KEY (stack_id, class_id))",
+	"CREATE TABLE heap_snapshots (id INTEGER PRIMARY KEY, time INTEGER, reason TEXT, duration INTEGER, classes INTEGER, instances INTEGER, bytes INTEGER)",
+	"CREATE TABLE heap_histogram (snapshot_id INTEGER, class_id INTEGER, instances INTEGER, bytes INTEGER, PRIMARY KEY (snapshot_id, class_id))",
+	"CREATE VIEW heap_growth AS SELECT DISTINCT censuses.id AS snapshot_id, ids.class_id AS class_id, coalesce(current.instances, 0) - coalesce(previous.instances, 0) AS instances, coalesce(current.bytes, 0) - coalesce(previous.bytes, 0) AS bytes FROM (SELECT id, (SELECT max(earlier.id) FROM heap_snapshots AS earlier WHERE earlier.id < later.id) AS previous_id FROM heap_snapshots AS later) AS censuses JOIN heap_histogram AS ids ON ids.snapshot_id IN (censuses.id, censuses.previous_id) LEFT JOIN heap_histogram AS current ON current.snapshot_id = censuses.id AND current.class_id = ids.class_id LEFT JOIN heap_histogram AS previous ON previous.snapshot_id = censuses.previous_id AND previous.class_id = ids.class_id",
+	"CREATE TABLE retention_paths (id INTEGER PRIMARY KEY, snapshot_id INTEGER, class_id INTEGER, root TEXT, samples INTEGER)",
+	"CREATE TABLE retention_links (path_id INTEGER, depth INTEGER, class_id INTEGER, repeat_count INTEGER, PRIMARY KEY (path_id, depth))",
+)
+
+# The agent maintains the summaries while recording, a recovered DB gets them
+# from its traces
+RECOVER_SUMMARIES = (
+	"INSERT INTO fqn_summary SELECT fqn_id, count(*), min(enter_seq), max(enter_seq) FROM traces GROUP BY fqn_id",
+	"INSERT INTO thread_summary SELECT thread_id, count(*), min(enter_seq), max(enter_seq) FROM traces GROUP BY thread_id",
+	"""INSERT INTO class_summary SELECT fqns.class_id, count(*), min(traces.enter_seq), max(traces.enter_seq)
+	   FROM traces JOIN fqns ON fqns.id = traces.fqn_id GROUP BY fqns.class_id""",
+)
+
+SUMMARY_TOP = 20
+
+def load_journal_symbols(symbols_path):
+	threads, methods = {}, {}
+	if not os.path.isfile(symbols_path):
+		print "No symbols at %s, the names will be missing" % symbols_path
+		return threads, methods
+
+	for line in open(symbols_path):
+		fields = line.rstrip('\n').split('\t')
+		# The last line can be cut by the crash
+		if fields[0] == 'T' and len(fields) == 3:
+			threads[int(fields[1])] = fields[2]
+		elif fields[0] == 'M' and len(fields) == 5:
+			methods[int(fields[1])] = tuple(fields[2:])
+	return threads, methods
+
+
+# Rebuild a DB from the crash journal left by the agent (`journal` option):
+# the last events recorded before the JVM died
+def recover(conf):
+	if not os.path.isfile(conf['recover']):
+		raise Exception("The journal argument should point to the agent journal")
+	if os.path.exists(conf['db']):
+		raise Exception("The recovered DB is written to a new file, %s already exists" % conf['db'])
+
+	journal = open(conf['recover'], 'rb')
+	data = mmap.mmap(journal.fileno(), 0, access=mmap.ACCESS_READ)
+	magic, record_size, capacity, head, state = JOURNAL_HEADER.unpack_from(data, 0)
+	if magic != JOURNAL_MAGIC or record_size != JOURNAL_RECORD.size:
+		raise Exception("%s is not a journal of this agent" % conf['recover'])
+
+	first = max(0, head - capacity)
+	print "Journal: %d events written, %d kept, state: %s" % (head, head - first, JOURNAL_STATES[state] if state < len(JOURNAL_STATES) else state)
+
+	threads, methods = load_journal_symbols(conf['recover'] + '.symbols')
+
+	database = sqlite3.connect(conf['db'])
+	for query in RECOVER_SCHEMA:
+		database.execute(query)
+
+	for thread_no, thread_name in threads.iteritems():
+		database.execute("INSERT INTO threads VALUES (?, ?)", (thread_no, thread_name))
+
+	names = {'classes' : {}, 'methods' : {}, 'signatures' : {}}
+	def name_key(table, name):
+		keys = names[table]
+		if name not in keys:
+			keys[name] = database.execute("INSERT INTO %s VALUES (NULL, ?)" % table, (name,)).lastrowid
+		return keys[name]
+
+	fqns = {}
+	def fqn_key(method_id):
+		if method_id not in fqns:
+			class_name, method_name, signature_name = methods.get(method_id, (None, None, None))
+			fqn = (name_key('classes', class_name), name_key('methods', method_name), name_key('signatures', signature_name), method_id)
+			fqns[method_id] = database.execute("INSERT INTO fqns VALUES (NULL, ?, ?, ?, ?)", fqn).lastrowid
+		return fqns[method_id]
+
+	torn, stacks, exits = 0, set(), []
+	for index in xrange(first, head):
+		record = JOURNAL_RECORD.unpack_from(data, JOURNAL_RECORDS_OFFSET + (index % capacity) * record_size)
+		stamp, trace_id, parent_trace_id, sequence, timestamp, stack_id, parent_stack_id, method_id, transaction_id, thread_no, depth, kind, flags = record
+		if stamp != index + 1:
+			torn += 1
+			continue
+
+		if kind == JOURNAL_ENTRY:
+			fqn_id = fqn_key(method_id)
+			database.execute("INSERT INTO traces VALUES (?, ?, ?, ?, ?, ?, NULL, ?, 1, ?)",
+			                 (trace_id, thread_no, fqn_id, parent_trace_id, depth, sequence, stack_id, transaction_id))
+			if stack_id not in stacks:
+				stacks.add(stack_id)
+				database.execute("INSERT INTO stacks VALUES (?, ?, ?, ?)", (stack_id, parent_stack_id, fqn_id, depth))
+		elif kind == JOURNAL_EXIT:
+			exits.append((sequence, trace_id))
+
+	# Exits of calls entered before the oldest kept event update nothing
+	database.executemany("UPDATE traces SET exit_seq = ? WHERE id = ?", exits)
+	for query in RECOVER_SUMMARIES:
+		database.execute(query)
+	database.commit()
+	database.close()
+	data.close()
+	journal.close()
+
+	if torn:
+		print "Skipped %d incomplete events" % torn
+	finalize(conf)
+
+
+def finalize(conf):
+	if not os.path.isfile(conf['db']):
+		raise Exception("The DB argument should point to the SQLite database")
+
+	database = sqlite3.connect(conf['db'])
+	for query in FINALIZE_QUERIES:
+		try:
+			database.execute(query)
+		except sqlite3.OperationalError, e:
+			# Captures from older agents miss some of the tables
+			print "Cannot run '%s': %s" % (query, e)
+	database.commit()
+	database.close()
+
+
+# Java name of a class signature ("Ljava/lang/String;" -> "java.lang.String");
+# the arrays and the unnamed classes are kept as they are
+def java_class_name(signature):
+	if signature.startswith('L') and signature.endswith(';'):
+		signature = signature[1:-1]
+	return signature.replace('/', '.')
+
+
+# Export the traces as folded stacks ("frame;frame;frame count"), the input
+# format of flamegraph.pl
+def flamegraph(conf):
+	if not os.path.isfile(conf['db']):
+		raise Exception("The DB argument should point to the SQLite database")
+
+	database = sqlite3.connect(conf['db'])
+	cursor = database.cursor()
+
+	frames = {}
+	query = """select fqns.id, classes.class_name, methods.method_name
+	           from fqns
+	           left join classes on classes.id = fqns.class_id
+	           left join methods on methods.id = fqns.method_id"""
+	cursor.execute(query)
+	for row in cursor:
+		# Methods never named (e.g. crash before the symbolizer ran)
+		class_name = java_class_name(row[1] or '?')
+		frames[row[0]] = "%s.%s" % (class_name, row[2])
+
+	stacks = {}
+	cursor.execute("select id, parent_stack_id, fqn_id from stacks")
+	for row in cursor:
+		stacks[row[0]] = (row[1], row[2])
+
+	folded = {}
+	def fold(stack_id):
+		# Walk up to the closest path already folded (stacks can be deep)
+		path = []
+		while stack_id in stacks and stack_id not in folded:
+			path.append(stack_id)
+			stack_id = stacks[stack_id][0]
+		prefix = folded.get(stack_id)
+		for current_id in reversed(path):
+			frame = frames.get(stacks[current_id][1], str(stacks[current_id][1]))
+			prefix = prefix + ';' + frame if prefix else frame
+			folded[current_id] = prefix
+		return prefix
+
+	# A folded row stands for `repeat_count` copies of its whole subtree. Ids
+	# follow the entry order, so a caller is always seen before its callees
+	counts = {}
+	multiplier = {}
+	cursor.execute("select id, parent_trace_id, stack_id, repeat_count from traces order by id")
+	for row in cursor:
+		count = (row[3] or 1) * multiplier.get(row[1], 1)
+		if count > 1:
+			multiplier[row[0]] = count
+		counts[row[2]] = counts.get(row[2], 0) + count
+
+	out = open(conf['flamegraph'], 'w')
+	for stack_id, count in counts.iteritems():
+		if stack_id in stacks:
+			out.write("%s %d\n" % (fold(stack_id), count))
+	out.close()
+
+
+# With tail sampling, the worker only got the calls of the kept (slow)
+# transactions: say so above the numbers built from them
+def print_tail_sampling(cursor):
+	cursor.execute("select name, value from agent_metrics where name like 'agent.tail.%'")
+	metrics = dict(cursor.fetchall())
+	if not metrics.get('agent.tail.sampled'):
+		return
+	kept = metrics.get('agent.tail.kept', 0)
+	print "Tail sampled: only the %d slow transactions kept (of %d) are counted" % (kept, kept + metrics.get('agent.tail.discarded', 0))
+
+
+# Hot methods and thread activity, from the summary tables
+def summary(conf):
+	if not os.path.isfile(conf['db']):
+		raise Exception("The DB argument should point to the SQLite database")
+
+	database = sqlite3.connect(conf['db'])
+	cursor = database.cursor()
+	print_tail_sampling(cursor)
+
+	print "Hot methods:"
+	query = """select fqn_summary.calls, classes.class_name, methods.method_name, signatures.signature_name
+	           from fqn_summary
+	           left join fqns on fqns.id = fqn_summary.fqn_id
+	           left join classes on classes.id = fqns.class_id
+	           left join methods on methods.id = fqns.method_id
+	           left join signatures on signatures.id = fqns.signature_id
+	           order by fqn_summary.calls desc
+	           limit %d""" % SUMMARY_TOP
+	cursor.execute(query)
+	for row in cursor:
+		print "  %10d  %s%s%s" % row
+
+	print "Threads:"
+	query = """select thread_summary.calls, thread_summary.first_seq, thread_summary.last_seq, threads.thread_name
+	           from thread_summary
+	           left join threads on threads.id = thread_summary.thread_id
+	           order by thread_summary.calls desc"""
+	cursor.execute(query)
+	for row in cursor:
+		print "  %10d  [%d, %d]  %s" % row
+
+
+# Percentiles of the call durations, from the latency histograms. The buckets
+# of the thread groups are added up; a percentile is the upper bound (ns) of
+# its bucket
+def latency(conf):
+	if not os.path.isfile(conf['db']):
+		raise Exception("The DB argument should point to the SQLite database")
+
+	database = sqlite3.connect(conf['db'])
+	cursor = database.cursor()
+
+	histograms = {}
+	cursor.execute("""select fqn_id, bucket, max(high), sum(calls)
+	                  from latency_histograms
+	                  group by fqn_id, bucket
+	                  order by fqn_id, bucket""")
+	for row in cursor:
+		histograms.setdefault(row[0], []).append((row[2], row[3]))
+
+	def percentile(buckets, total, percent):
+		rank = max(1, int(math.ceil(total * percent / 100.0)))
+		seen = 0
+		for high, calls in buckets:
+			seen += calls
+			if seen >= rank:
+				return high
+		return buckets[-1][0]
+
+	names = {}
+	cursor.execute("""select fqns.id, classes.class_name, methods.method_name
+	                  from fqns
+	                  left join classes on classes.id = fqns.class_id
+	                  left join methods on methods.id = fqns.method_id""")
+	for row in cursor:
+		names[row[0]] = "%s%s" % (row[1], row[2])
+
+	rows = []
+	for fqn_id, buckets in histograms.iteritems():
+		total = sum(calls for high, calls in buckets)
+		rows.append((percentile(buckets, total, 99), total, fqn_id, buckets))
+	rows.sort(reverse=True)
+
+	print_tail_sampling(cursor)
+	print "  %10s  %12s  %12s  %12s  %s" % ('calls', 'p50 (ns)', 'p99 (ns)', 'p99.9 (ns)', 'method')
+	for p99, total, fqn_id, buckets in rows[:SUMMARY_TOP]:
+		print "  %10d  %12d  %12d  %12d  %s" % (total, percentile(buckets, total, 50), p99,
+		                                        percentile(buckets, total, 99.9), names.get(fqn_id, str(fqn_id)))
+
+
+# Most frequent throw sites, from the exception summary
+def exceptions(conf):
+	if not os.path.isfile(conf['db']):
+		raise Exception("The DB argument should point to the SQLite database")
+
+	database = sqlite3.connect(conf['db'])
+	cursor = database.cursor()
+
+	query = """select exception_summary.throws, exception_summary.caught, exception_summary.frames_unwound,
+	                  exceptions.class_name, classes.class_name, methods.method_name, exception_summary.throw_location
+	           from exception_summary
+	           left join classes as exceptions on exceptions.id = exception_summary.class_id
+	           left join fqns on fqns.id = exception_summary.throw_fqn_id
+	           left join classes on classes.id = fqns.class_id
+	           left join methods on methods.id = fqns.method_id
+	           order by exception_summary.throws desc
+	           limit %d""" % SUMMARY_TOP
+	cursor.execute(query)
+	print "  %10s  %10s  %8s  %s" % ('throws', 'caught', 'unwound', 'exception @ throw site')
+	for row in cursor:
+		unwound = float(row[2]) / row[0] if row[0] else 0
+		print "  %10d  %10d  %8.1f  %s @ %s%s:%d" % (row[0], row[1], unwound, row[3], row[4], row[5], row[6])
+
+
+# Printer of the interned call paths, from the top of the path
+def call_paths(cursor):
+	frames = {}
+	cursor.execute("""select fqns.id, classes.class_name, methods.method_name
+	                  from fqns
+	                  left join classes on classes.id = fqns.class_id
+	                  left join methods on methods.id = fqns.method_id""")
+	for row in cursor:
+		frames[row[0]] = "%s.%s" % (java_class_name(row[1] or '?'), row[2])
+
+	stacks = {}
+	cursor.execute("select id, parent_stack_id, fqn_id from stacks")
+	for row in cursor:
+		stacks[row[0]] = (row[1], row[2])
+
+	def print_path(stack_id, indent):
+		while stack_id in stacks:
+			print "%s%s" % (' ' * indent, frames.get(stacks[stack_id][1], str(stacks[stack_id][1])))
+			stack_id = stacks[stack_id][0]
+	return print_path
+
+
+# Allocation hotspots per site, then per call path. A sample stands for about
+# `agent.allocations.interval` bytes
+def allocations(conf):
+	if not os.path.isfile(conf['db']):
+		raise Exception("The DB argument should point to the SQLite database")
+
+	database = sqlite3.connect(conf['db'])
+	cursor = database.cursor()
+
+	cursor.execute("select value from agent_metrics where name = 'agent.allocations.interval'")
+	row = cursor.fetchone()
+	interval = row[0] if row else 0
+
+	print "Allocation sites:"
+	query = """select allocation_sites.samples, allocation_sites.bytes, allocated.class_name,
+	                  classes.class_name, methods.method_name, allocation_sites.site_location
+	           from allocation_sites
+	           left join classes as allocated on allocated.id = allocation_sites.class_id
+	           left join fqns on fqns.id = allocation_sites.site_fqn_id
+	           left join classes on classes.id = fqns.class_id
+	           left join methods on methods.id = fqns.method_id
+	           order by allocation_sites.samples desc
+	           limit %d""" % SUMMARY_TOP
+	cursor.execute(query)
+	print "  %10s  %14s  %12s  %s" % ('samples', '~allocated (MB)', 'avg size', 'class @ site')
+	for row in cursor:
+		print "  %10d  %14.1f  %12d  %s @ %s%s:%d" % (row[0], row[0] * interval / 1048576.0, row[1] / row[0], row[2], row[3], row[4], row[5])
+
+	print_path = call_paths(cursor)
+
+	print "Call paths:"
+	query = """select allocation_stacks.stack_id, allocation_stacks.samples, classes.class_name
+	           from allocation_stacks
+	           left join classes on classes.id = allocation_stacks.class_id
+	           order by allocation_stacks.samples desc
+	           limit %d""" % SUMMARY_TOP
+	cursor.execute(query)
+	for row in cursor.fetchall():
+		print "  %10d  %14.1f  %s" % (row[1], row[1] * interval / 1048576.0, row[2])
+		print_path(row[0], 30)
+
+
+# Time blocked on the monitors per lock site, then per call path (contended
+# enters only, the waits are often idle threads)
+def monitors(conf):
+	if not os.path.isfile(conf['db']):
+		raise Exception("The DB argument should point to the SQLite database")
+
+	database = sqlite3.connect(conf['db'])
+	cursor = database.cursor()
+
+	print "Lock sites:"
+	query = """select monitor_sites.wait, monitor_sites.events, monitor_sites.blocked_time, monitor_sites.max_blocked_time,
+	                  monitors.class_name, classes.class_name, methods.method_name, monitor_sites.site_location
+	           from monitor_sites
+	           left join classes as monitors on monitors.id = monitor_sites.class_id
+	           left join fqns on fqns.id = monitor_sites.site_fqn_id
+	           left join classes on classes.id = fqns.class_id
+	           left join methods on methods.id = fqns.method_id
+	           order by monitor_sites.blocked_time desc
+	           limit %d""" % SUMMARY_TOP
+	cursor.execute(query)
+	print "  %5s  %10s  %12s  %12s  %s" % ('kind', 'events', 'blocked (ms)', 'max (ms)', 'monitor @ site')
+	for row in cursor:
+		kind = 'wait' if row[0] else 'enter'
+		print "  %5s  %10d  %12.3f  %12.3f  %s @ %s%s:%d" % (kind, row[1], row[2] / 1e6, row[3] / 1e6, row[4], row[5], row[6], row[7])
+
+	print_path = call_paths(cursor)
+
+	print "Call paths:"
+	query = """select monitor_stacks.stack_id, monitor_stacks.events, monitor_stacks.blocked_time, classes.class_name
+	           from monitor_stacks
+	           left join classes on classes.id = monitor_stacks.class_id
+	           where monitor_stacks.wait = 0
+	           order by monitor_stacks.blocked_time desc
+	           limit %d""" % SUMMARY_TOP
+	cursor.execute(query)
+	for row in cursor.fetchall():
+		print "  %10d  %12.3f  %s" % (row[1], row[2] / 1e6, row[3])
+		print_path(row[0], 28)
+
+
+# Heap censuses, the classes which grew the most since the previous one, then
+# the retention paths of the last leak suspects, from their roots
+def heap(conf):
+	if not os.path.isfile(conf['db']):
+		raise Exception("The DB argument should point to the SQLite database")
+
+	database = sqlite3.connect(conf['db'])
+	cursor = database.cursor()
+
+	print "Heap censuses:"
+	cursor.execute("select id, time, reason, duration, classes, instances, bytes from heap_snapshots order by id")
+	snapshots = cursor.fetchall()
+	print "  %5s  %12s  %10s  %10s  %8s  %12s  %12s" % ('id', 'time (s)', 'reason', 'pause (ms)', 'classes', 'instances', 'bytes (MB)')
+	for row in snapshots:
+		print "  %5d  %12.3f  %10s  %10.3f  %8d  %12d  %12.1f" % (row[0], (row[1] - snapshots[0][1]) / 1e9, row[2], row[3] / 1e6, row[4], row[5], row[6] / 1048576.0)
+
+	if len(snapshots) < 2:
+		return
+
+	print "Growth since census %d:" % snapshots[-2][0]
+	query = """select heap_growth.bytes, heap_growth.instances, classes.class_name
+	           from heap_growth
+	           left join classes on classes.id = heap_growth.class_id
+	           where heap_growth.snapshot_id = ?
+	           order by heap_growth.bytes desc
+	           limit %d""" % SUMMARY_TOP
+	cursor.execute(query, (snapshots[-1][0], ))
+	print "  %12s  %12s  %s" % ('bytes', 'instances', 'class')
+	for row in cursor:
+		print "  %+12d  %+12d  %s" % (row[0], row[1], row[2])
+
+	query = """select retention_paths.id, retention_paths.snapshot_id, retention_paths.root, retention_paths.samples, classes.class_name
+	           from retention_paths
+	           left join classes on classes.id = retention_paths.class_id
+	           where retention_paths.snapshot_id = (select max(snapshot_id) from retention_paths)
+	           order by classes.class_name, retention_paths.samples desc"""
+	cursor.execute(query)
+	paths = cursor.fetchall()
+	if not paths:
+		return
+
+	print "Retention paths at census %d:" % paths[0][1]
+	print "  %8s  %s" % ('samples', 'root -> links -> class')
+	for row in paths:
+		cursor.execute("""select retention_links.depth, retention_links.repeat_count, classes.class_name
+		                  from retention_links
+		                  left join classes on classes.id = retention_links.class_id
+		                  where retention_links.path_id = ?
+		                  order by retention_links.depth""", (row[0], ))
+		links = ['(%s)' % row[2]]
+		depth = 0
+		for link in cursor:
+			if link[0] > depth:
+				links.append('...')
+			links.append(link[2] + (' x%d' % link[1] if link[1] > 1 else ''))
+			depth = link[0] + 1
+		links.append(row[4])
+		print "  %8d  %s" % (row[3], ' -> '.join(links))
+
+
 def process(conf):
 	if not os.path.isfile(conf['db']):
 		raise Exception("The DB argument should point to the SQLite database")
@@ -69,7 +578,7 @@ def process(conf):
 		traces_selectors[thread_id].append(row)
 
 	trace_info = {}
-	trace_query = """select traces.id, fqns.id, classes.class_name, methods.method_name, traces.parent_trace_id
+	trace_query = """select traces.id, fqns.id, classes.class_name, methods.method_name, traces.parent_trace_id, traces.depth, traces.repeat_count
 	                 from traces
 	                 left join fqns on fqns.id = traces.fqn_id
 	                 left join classes on classes.id = fqns.class_id
@@ -81,29 +590,71 @@ def process(conf):
 	ex = 18173553
 	thid = 35
 	cursor.execute(trace_query, (ex, ex, thid))
-	indent = {}
-	cur_indent = ""
 	for row in cursor:
-		parent_id = row[4]
-		if parent_id not in indent:
-			cur_indent += "  "
-			indent[parent_id] = cur_indent
-		else:
-			cur_indent = indent[parent_id]
-		print cur_indent, row[2], row[3]
+		# Folded rows stand for `repeat_count` identical consecutive calls
+		repeat = " (x%d)" % row[6] if row[6] > 1 else ""
+		print "  " * (int(row[5]) + 1), row[2], row[3] + repeat
 
 
 
 def main(argc, argv):
 	conf = {
-		'db' : None
+		'db' : None,
+		'finalize' : False,
+		'flamegraph' : None,
+		'recover' : None,
+		'summary' : False,
+		'latency' : False,
+		'exceptions' : False,
+		'monitors' : False,
+		'allocations' : False,
+		'heap' : False
 	}
 	for i in range(argc):
 		s = argv[i]
 		if s in ('--database', '-d'):
 			conf['db'] = __normalize_path(argv[i + 1])
+		elif s in ('--finalize', '-f'):
+			conf['finalize'] = True
+		elif s in ('--flamegraph', '-g'):
+			conf['flamegraph'] = __normalize_path(argv[i + 1])
+		elif s in ('--summary', '-s'):
+			conf['summary'] = True
+		elif s in ('--latency', '-l'):
+			conf['latency'] = True
+		elif s in ('--exceptions', '-e'):
+			conf['exceptions'] = True
+		elif s in ('--monitors', '-m'):
+			conf['monitors'] = True
+		elif s in ('--allocations', '-a'):
+			conf['allocations'] = True
+		elif s in ('--heap', '-H'):
+			conf['heap'] = True
+		elif s in ('--recover', '-r'):
+			conf['recover'] = __normalize_path(argv[i + 1])
+
+	if conf['recover']:
+		recover(conf)
+		return
 
-	process(conf)
+	if conf['finalize']:
+		finalize(conf)
+	if conf['flamegraph']:
+		flamegraph(conf)
+	elif conf['summary']:
+		summary(conf)
+	elif conf['latency']:
+		latency(conf)
+	elif conf['exceptions']:
+		exceptions(conf)
+	elif conf['monitors']:
+		monitors(conf)
+	elif conf['allocations']:
+		allocations(conf)
+	elif conf['heap']:
+		heap(conf)
+	else:
+		process(conf)
 
 
 if __name__ == "__main__":